@@ -29,8 +29,10 @@
 #include <linux/interrupt.h>
 #include <linux/highmem.h>
 #include <linux/freezer.h>
-#include <media/videobuf-vmalloc.h>
+#include <media/videobuf2-v4l2.h>
+#include <media/videobuf2-vmalloc.h>
 #include <media/v4l2-dev.h>
+#include <media/v4l2-device.h>
 #include <media/v4l2-common.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
 #include <media/v4l2-ioctl.h>
@@ -39,6 +41,10 @@
 #include <linux/vmalloc.h>
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+#error "coach needs the videobuf2 of linux 4.8 or later"
+#endif
+
 #define COACH_MODULE_NAME "coach10p"
 
 #define V4L2_CID_SENSORFLIP                     (V4L2_CID_PRIVATE_BASE+0)
@@ -184,14 +190,16 @@ unsigned char JFIF_HEADER[636] = {
 };
 
 /* Camera */
-#define FRAMES 1
+#define MAX_FRAMES 16		/* most frames kept for a late reader */
 #define MAX_FRAME_SIZE 200000
-#define BUFFER_SIZE 0x1000
+#define BUFFER_SIZE 0x4000	/* default bytes per bulk urb */
+#define MAX_URBS 16
 #define CTRL_TIMEOUT 500
 
 #define ZR364XX_DEF_BUFS	4
 #define ZR364XX_READ_IDLE	0
 #define ZR364XX_READ_FRAME	1
+#define ZR364XX_READ_READY	2	/* complete, waiting for a queued buffer */
 
 /* Wake up at about 30 fps */
 #define WAKE_NUMERATOR 30
@@ -212,6 +220,18 @@ static unsigned debug = 0;
 module_param(debug, uint, 0644);
 MODULE_PARM_DESC(debug, "activates debug info");
 
+static unsigned urbs = 4;
+module_param(urbs, uint, 0444);
+MODULE_PARM_DESC(urbs, "bulk urbs in flight (1-16)");
+
+static unsigned urb_size = BUFFER_SIZE;
+module_param(urb_size, uint, 0444);
+MODULE_PARM_DESC(urb_size, "bytes per bulk urb, rounded up to a multiple of the packet size");
+
+static unsigned frames = 4;
+module_param(frames, uint, 0444);
+MODULE_PARM_DESC(frames, "frames kept for a late reader (1-16)");
+
 /* Debug macro */
 #define DBG(fmt, args...) \
 	do { \
@@ -328,7 +348,8 @@ static struct coach_fmt formats[] = {
 /* buffer for one video frame */
 struct coach_buffer {
     /* common v4l buffer stuff -- must be first */
-    struct videobuf_buffer vb;
+    struct vb2_v4l2_buffer vb;
+    struct list_head list;	/* in coach_dmaqueue.active */
     const struct coach_fmt *fmt;
 };
 
@@ -344,15 +365,28 @@ struct coach_dmaqueue {
 /* frame structure */
 struct zr364xx_framei {
 	unsigned long ulState;	/* ulState:ZR364XX_READ_IDLE,
-					   ZR364XX_READ_FRAME */
+					   ZR364XX_READ_FRAME,
+					   ZR364XX_READ_READY */
 	void *lpvbits;		/* image data */
 	unsigned long cur_size;	/* current data copied to it */
+	long eoi;		/* offset of the last EOI marker, or -1 */
+	long junk;		/* offset of the first junk marker, or -1 */
+	int overflow;		/* data was discarded, the frame is dropped */
+	u32 sequence;		/* of a ready frame */
+	u64 timestamp;		/* of a ready frame, in ns */
 };
 
-/* image buffer structure */
+/*
+ * image buffer structure: a ring of staging frames for when no buffer is
+ * queued.  The ready frames go to the reader oldest first; the frame after
+ * them is the one being assembled.
+ */
 struct coach_bufferi {
     unsigned long dwFrames;                    /* number of frames in buffer */
-    struct zr364xx_framei frame[FRAMES];       /* array of FRAME structures */
+    unsigned long head;                        /* oldest ready frame */
+    unsigned long ready;                       /* number of ready frames */
+    unsigned long dropped;                     /* ready frames overwritten */
+    struct zr364xx_framei frame[MAX_FRAMES + 1]; /* the kept frames + the one being assembled */
 };
 
 struct coach_pipeinfo {
@@ -363,6 +397,7 @@ struct coach_pipeinfo {
     void *cam;	/* back pointer to coach_dev struct */
     u32 err_count;
     u32 idx;
+    u32 seq;	/* submission order */
 };
 
 struct coach_dev {
@@ -372,23 +407,31 @@ struct coach_dev {
     spinlock_t slock;
     struct mutex mutex;
     struct mutex open_lock;
+    struct mutex queue_lock;	/* ioctls and the vb2 queue */
 
     int users;
     int removed;
 
     /* various device info */
+    struct v4l2_device v4l2_dev;
     struct video_device *vfd;
     struct coach_dmaqueue vidq;
 
     /* usb */
     u8 read_endpoint;
+    u16 read_maxpacket;
 
     /* pipeline */
     int			        b_acquire;
-    int			        last_frame;
-    int			        cur_frame;
+    int			        cur_frame;	/* staging frame being assembled */
     unsigned long		frame_count;
-    struct coach_pipeinfo	pipe[1];
+    struct coach_pipeinfo	pipe[MAX_URBS];
+    int			        nr_pipes;
+    u32			        submit_seq;	/* of the next urb submitted */
+    u32			        read_seq;	/* of the next urb expected to complete */
+    int			        resync;		/* data was lost: skip to the end of the frame */
+    struct coach_buffer	       *cur_buf;	/* queued buffer the frame is assembled in */
+    unsigned long		cur_buf_size;	/* its size */
     struct coach_bufferi	buffer;
 
     int nb;
@@ -403,34 +446,45 @@ struct coach_dev {
     /* video capture */
     struct coach_fmt           *fmt;
     __u32  width, height;
-    struct videobuf_queue      vb_vidq;
+    struct vb2_queue           vb_vidq;
 
     enum v4l2_buf_type         type;
 };
 
 static void coach_destroy(struct coach_dev *dev);
 static void read_pipe_completion(struct urb *purb);
+static void zr364xx_flush_frames(struct coach_dev *cam);
 
 /* starts acquisition process */
 static int zr364xx_start_acquire(struct coach_dev *cam)
 {
+    unsigned long flags;
     int j;
 
     DBG("start acquire\n");
 
-    cam->last_frame = -1;
+    /* the frames of the last stream are stale */
+    spin_lock_irqsave(&cam->slock, flags);
     cam->cur_frame = 0;
-    for (j = 0; j < FRAMES; j++) {
+    cam->buffer.head = 0;
+    cam->buffer.ready = 0;
+    cam->buffer.dropped = 0;
+    for (j = 0; j < cam->buffer.dwFrames; j++) {
         cam->buffer.frame[j].ulState = ZR364XX_READ_IDLE;
         cam->buffer.frame[j].cur_size = 0;
     }
     cam->b_acquire = 1;
+    spin_unlock_irqrestore(&cam->slock, flags);
     return 0;
 }
 
 static inline int zr364xx_stop_acquire(struct coach_dev *cam)
 {
+    unsigned long flags;
+
+    spin_lock_irqsave(&cam->slock, flags);
     cam->b_acquire = 0;
+    spin_unlock_irqrestore(&cam->slock, flags);
     return 0;
 }
 
@@ -517,51 +571,95 @@ coach_get_param(struct usb_device *udev, uint16_t param, uint16_t *value)
     return status;
 }
 
+/* cancel and free the urbs of the read pipe */
+static void zr364xx_kill_urbs(struct coach_dev *cam)
+{
+    int i;
+
+    /* no completion resubmits from now on */
+    for (i = 0; i < cam->nr_pipes; i++)
+        cam->pipe[i].state = 0;
+
+    for (i = 0; i < cam->nr_pipes; i++) {
+        struct coach_pipeinfo *pipe_info = &cam->pipe[i];
+
+        if (pipe_info->stream_urb) {
+            /* cancel urb */
+            usb_kill_urb(pipe_info->stream_urb);
+            usb_free_urb(pipe_info->stream_urb);
+            pipe_info->stream_urb = NULL;
+        }
+    }
+}
+
+/* keep cam->nr_pipes bulk urbs queued on the endpoint; they complete
+ * in submission order, so the frame is assembled in the completions */
 static int zr364xx_start_readpipe(struct coach_dev *cam)
 {
     int pipe;
     int retval;
-    struct coach_pipeinfo *pipe_info = cam->pipe;
+    int i;
+    struct coach_pipeinfo *pipe_info;
 
     if(cam->removed)
         return -EINVAL;
 
+    if (cam->pipe[0].stream_urb) {
+        DBG("%s: read pipe already running\n", __func__);
+        return 0;
+    }
+
     if(coach_set_param(cam->udev, PRMID_REQ_STREAM, 1) < 0) {
         dev_err(&cam->udev->dev, "Request stream failed\n");
         return -EINVAL;
     }
     
     pipe = usb_rcvbulkpipe(cam->udev, cam->read_endpoint);
-    DBG("%s: start pipe IN x%x\n", __func__, cam->read_endpoint);
-    pipe_info->state = 1;
-    pipe_info->err_count = 0;
-    pipe_info->stream_urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (!pipe_info->stream_urb) {
-        dev_err(&cam->udev->dev, "ReadStream: Unable to alloc URB\n");
-        return -ENOMEM;
-    }
+    DBG("%s: start pipe IN x%x, %d urbs of %u bytes\n", __func__,
+            cam->read_endpoint, cam->nr_pipes, cam->pipe[0].transfer_size);
+    for (i = 0; i < cam->nr_pipes; i++) {
+        pipe_info = &cam->pipe[i];
+        pipe_info->err_count = 0;
+        pipe_info->stream_urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!pipe_info->stream_urb) {
+            dev_err(&cam->udev->dev, "ReadStream: Unable to alloc URB\n");
+            retval = -ENOMEM;
+            goto fail;
+        }
 
-    /* transfer buffer allocated in board_init */
-    usb_fill_bulk_urb(pipe_info->stream_urb, cam->udev,
-            pipe,
-            pipe_info->transfer_buffer,
-            pipe_info->transfer_size,
-            read_pipe_completion, pipe_info);
+        /* transfer buffer allocated in board_init */
+        usb_fill_bulk_urb(pipe_info->stream_urb, cam->udev,
+                pipe,
+                pipe_info->transfer_buffer,
+                pipe_info->transfer_size,
+                read_pipe_completion, pipe_info);
+        pipe_info->state = 1;
+    }
 
-    DBG("submitting URB %p\n", pipe_info->stream_urb);
-    retval = usb_submit_urb(pipe_info->stream_urb, GFP_KERNEL);
-    if (retval) {
-        printk(KERN_ERR KBUILD_MODNAME ": start read pipe failed\n");
-        return retval;
+    cam->submit_seq = 0;
+    cam->read_seq = 0;
+    cam->resync = 0;
+    for (i = 0; i < cam->nr_pipes; i++) {
+        pipe_info = &cam->pipe[i];
+        pipe_info->seq = cam->submit_seq++;
+        DBG("submitting URB %p\n", pipe_info->stream_urb);
+        retval = usb_submit_urb(pipe_info->stream_urb, GFP_KERNEL);
+        if (retval) {
+            printk(KERN_ERR KBUILD_MODNAME ": start read pipe failed\n");
+            goto fail;
+        }
     }
 
     return 0;
+
+fail:
+    zr364xx_kill_urbs(cam);
+    coach_set_param(cam->udev, PRMID_REQ_STREAM, 0);
+    return retval;
 }
 
 static void zr364xx_stop_readpipe(struct coach_dev *dev)
 {
-    struct coach_pipeinfo *pipe_info;
-
     if (dev == NULL) {
         printk(KERN_ERR KBUILD_MODNAME ": invalid device\n");
         return;
@@ -569,65 +667,48 @@ static void zr364xx_stop_readpipe(struct coach_dev *dev)
 
     DBG("stop read pipe\n");
 
-    pipe_info = dev->pipe;
-    if (pipe_info) {
-        if (pipe_info->state != 0)
-            pipe_info->state = 0;
-
-        if (pipe_info->stream_urb) {
-            /* cancel urb */
-            usb_kill_urb(pipe_info->stream_urb);
-            usb_free_urb(pipe_info->stream_urb);
-            pipe_info->stream_urb = NULL;
-        }
-    }
+    zr364xx_kill_urbs(dev);
     coach_set_param(dev->udev, PRMID_REQ_STREAM, 0);
     return;
 }
 
 
 /* ------------------------------------------------------------------
-	Videobuf operations
+	Videobuf2 operations
    ------------------------------------------------------------------*/
 static int 
-buffer_setup(struct videobuf_queue *vq, unsigned int *count, unsigned int *size)
+queue_setup(struct vb2_queue *vq, unsigned int *count, unsigned int *nplanes,
+        unsigned int sizes[], struct device *alloc_devs[])
 {
-    struct coach_dev  *dev = vq->priv_data;
+    struct coach_dev  *dev = vb2_get_drv_priv(vq);
+    unsigned int size = dev->width * dev->height * 2;
+
     dprintk(dev, 1, "%s\n", __func__);
 
-    *size = dev->width * dev->height * 2;
+    /* VIDIOC_CREATE_BUFS */
+    if (*nplanes)
+        return sizes[0] < size ? -EINVAL : 0;
+
+    *nplanes = 1;
+    sizes[0] = size;
     if (0 == *count)
         *count = ZR364XX_DEF_BUFS;
 
-    if (*size * *count > ZR364XX_DEF_BUFS * 1024 * 1024)
-        *count = (ZR364XX_DEF_BUFS * 1024 * 1024) / *size;
+    if (size * *count > ZR364XX_DEF_BUFS * 1024 * 1024)
+        *count = (ZR364XX_DEF_BUFS * 1024 * 1024) / size;
 
     return 0;
 }
 
-static void free_buffer(struct videobuf_queue *vq, struct coach_buffer *buf)
-{
-    struct coach_dev *dev = vq->priv_data;
-
-    dprintk(dev, 1, "%s, state: %i\n", __func__, buf->vb.state);
-
-    if (in_interrupt())
-        BUG();
-
-    videobuf_vmalloc_free(&buf->vb);
-    dprintk(dev, 1, "free_buffer: freed\n");
-    buf->vb.state = VIDEOBUF_NEEDS_INIT;
-}
-
 #define norm_maxw() 1280
 #define norm_maxh() 960
-static int buffer_prepare(struct videobuf_queue *vq, struct videobuf_buffer *vb, enum v4l2_field field)
+static int buffer_prepare(struct vb2_buffer *vb)
 {
-    struct coach_dev    *dev = vq->priv_data;
-    struct coach_buffer *buf = container_of(vb, struct coach_buffer, vb);
-    int rc;
+    struct coach_dev    *dev = vb2_get_drv_priv(vb->vb2_queue);
+    struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+    struct coach_buffer *buf = container_of(vbuf, struct coach_buffer, vb);
 
-    dprintk(dev, 1, "%s, field=%d\n", __func__, field);
+    dprintk(dev, 1, "%s\n", __func__);
 
     BUG_ON(NULL == dev->fmt);
 
@@ -635,58 +716,96 @@ static int buffer_prepare(struct videobuf_queue *vq, struct videobuf_buffer *vb,
             dev->height < 240 || dev->height > norm_maxh())
         return -EINVAL;
 
-    buf->vb.size = dev->width * dev->height * 2;
-    if (0 != buf->vb.baddr  &&  buf->vb.bsize < buf->vb.size)
+    /* USERPTR and DMABUF buffers come in any size */
+    if (vb2_plane_size(vb, 0) < dev->width * dev->height * 2)
         return -EINVAL;
 
     /* These properties only change when queue is idle, see s_fmt */
     buf->fmt       = dev->fmt;
-    buf->vb.width  = dev->width;
-    buf->vb.height = dev->height;
-    buf->vb.field  = field;
+    vbuf->field    = V4L2_FIELD_NONE;
 
-    if (VIDEOBUF_NEEDS_INIT == buf->vb.state) {
-        rc = videobuf_iolock(vq, &buf->vb, NULL);
-        if (rc < 0)
-            goto fail;
-    }
+    return 0;
+}
 
-    buf->vb.state = VIDEOBUF_PREPARED;
+static void buffer_queue(struct vb2_buffer *vb)
+{
+    struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+    struct coach_buffer    *buf  = container_of(vbuf, struct coach_buffer, vb);
+    struct coach_dev       *dev  = vb2_get_drv_priv(vb->vb2_queue);
+    struct coach_dmaqueue *vidq = &dev->vidq;
+    unsigned long flags = 0;
 
-    return 0;
+    dprintk(dev, 1, "%s\n", __func__);
 
-fail:
-    free_buffer(vq, buf);
-    return rc;
+    spin_lock_irqsave(&dev->slock, flags);
+    list_add_tail(&buf->list, &vidq->active);
+    /* a late reader: the frames kept for it come first */
+    zr364xx_flush_frames(dev);
+    spin_unlock_irqrestore(&dev->slock, flags);
 }
 
-static void buffer_queue(struct videobuf_queue *vq, struct videobuf_buffer *vb)
+/* give all buffers back to vb2: the read pipe is stopped */
+static void return_all_buffers(struct coach_dev *dev, enum vb2_buffer_state state)
 {
-    struct coach_buffer    *buf  = container_of(vb, struct coach_buffer, vb);
-    struct coach_dev       *dev  = vq->priv_data;
     struct coach_dmaqueue *vidq = &dev->vidq;
+    struct coach_buffer *buf, *tmp;
+    unsigned long flags = 0;
+
+    spin_lock_irqsave(&dev->slock, flags);
+    if (dev->cur_buf) {
+        vb2_buffer_done(&dev->cur_buf->vb.vb2_buf, state);
+        dev->cur_buf = NULL;
+    }
+    list_for_each_entry_safe(buf, tmp, &vidq->active, list) {
+        list_del(&buf->list);
+        vb2_buffer_done(&buf->vb.vb2_buf, state);
+    }
+    spin_unlock_irqrestore(&dev->slock, flags);
+}
+
+static int start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+    struct coach_dev *dev = vb2_get_drv_priv(vq);
+    int ret;
 
     dprintk(dev, 1, "%s\n", __func__);
 
-    buf->vb.state = VIDEOBUF_QUEUED;
-    list_add_tail(&buf->vb.queue, &vidq->active);
+    ret = zr364xx_start_readpipe(dev);
+    if (ret) {
+        return_all_buffers(dev, VB2_BUF_STATE_QUEUED);
+        return ret;
+    }
+    zr364xx_start_acquire(dev);
+    return 0;
 }
 
-static void buffer_release(struct videobuf_queue *vq,
-			   struct videobuf_buffer *vb)
+static void stop_streaming(struct vb2_queue *vq)
 {
-    struct coach_buffer   *buf  = container_of(vb, struct coach_buffer, vb);
-    struct coach_dev      *dev  = vq->priv_data;
+    struct coach_dev *dev = vb2_get_drv_priv(vq);
 
     dprintk(dev, 1, "%s\n", __func__);
-    free_buffer(vq, buf);
+
+    if (dev->b_acquire)
+        zr364xx_stop_acquire(dev);
+    if (dev->buffer.dropped)
+        dprintk(dev, 0, "%lu frames dropped, reader too late\n", dev->buffer.dropped);
+
+    /* no completion touches the buffers after this */
+    if (dev->removed)
+        zr364xx_kill_urbs(dev);
+    else
+        zr364xx_stop_readpipe(dev);
+    return_all_buffers(dev, VB2_BUF_STATE_ERROR);
 }
 
-static struct videobuf_queue_ops coach_video_qops = {
-    .buf_setup      = buffer_setup,
-    .buf_prepare    = buffer_prepare,
-    .buf_queue      = buffer_queue,
-    .buf_release    = buffer_release,
+static const struct vb2_ops coach_video_qops = {
+    .queue_setup     = queue_setup,
+    .buf_prepare     = buffer_prepare,
+    .buf_queue       = buffer_queue,
+    .start_streaming = start_streaming,
+    .stop_streaming  = stop_streaming,
+    .wait_prepare    = vb2_ops_wait_prepare,
+    .wait_finish     = vb2_ops_wait_finish,
 };
 
 /* ------------------------------------------------------------------
@@ -703,9 +822,10 @@ static int vidioc_querycap(struct file *file, void  *priv,
     strlcpy(cap->card, dev->udev->product, sizeof(cap->card));
     strlcpy(cap->bus_info, dev_name(&dev->udev->dev), sizeof(cap->bus_info));
     cap->version = COACH_VERSION;
-    cap->capabilities =	V4L2_CAP_VIDEO_CAPTURE |
+    cap->device_caps =	V4L2_CAP_VIDEO_CAPTURE |
         V4L2_CAP_STREAMING |
         V4L2_CAP_READWRITE;
+    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
     return 0;
 }
 
@@ -731,7 +851,7 @@ static int vidioc_g_fmt_vid_cap(struct file *file, void *priv,
 
     f->fmt.pix.width        = dev->width;
     f->fmt.pix.height       = dev->height;
-    f->fmt.pix.field        = dev->vb_vidq.field;
+    f->fmt.pix.field        = V4L2_FIELD_NONE;
     f->fmt.pix.pixelformat  = dev->fmt->fourcc;
     f->fmt.pix.bytesperline = (f->fmt.pix.width * dev->fmt->depth) >> 3;
     f->fmt.pix.sizeimage =
@@ -801,7 +921,6 @@ static int vidioc_s_fmt_vid_cap(struct file *file, void *priv,
 					struct v4l2_format *f)
 {
     struct coach_dev *dev = priv;
-    struct videobuf_queue *q = &dev->vb_vidq;
     int ret;
 
     if(dev->removed)
@@ -813,18 +932,15 @@ static int vidioc_s_fmt_vid_cap(struct file *file, void *priv,
         return ret;
     }
 
-    mutex_lock(&q->vb_lock);
-
-    if (videobuf_queue_is_busy(&dev->vb_vidq)) {
+    /* the v4l2 core holds queue_lock */
+    if (vb2_is_busy(&dev->vb_vidq)) {
         dprintk(dev, 1, "%s queue busy\n", __func__);
-        ret = -EBUSY;
-        goto out;
+        return -EBUSY;
     }
 
     dev->fmt           = get_format(f);
     dev->width         = f->fmt.pix.width;
     dev->height        = f->fmt.pix.height;
-    dev->vb_vidq.field = f->fmt.pix.field;
     dev->type          = f->type;
 
     zr364xx_stop_readpipe(dev);
@@ -855,45 +971,61 @@ static int vidioc_s_fmt_vid_cap(struct file *file, void *priv,
     mdelay(100);
     dev->skip = 2;
 
-    ret = 0;
-out:
-    mutex_unlock(&q->vb_lock);
-
-    return ret;
+    return 0;
 }
 
 static int vidioc_reqbufs(struct file *file, void *priv,
         struct v4l2_requestbuffers *p)
 {
     struct coach_dev  *dev = priv;
-    return (videobuf_reqbufs(&dev->vb_vidq, p));
+    return (vb2_reqbufs(&dev->vb_vidq, p));
+}
+
+static int vidioc_create_bufs(struct file *file, void *priv,
+        struct v4l2_create_buffers *p)
+{
+    struct coach_dev  *dev = priv;
+    return (vb2_create_bufs(&dev->vb_vidq, p));
 }
 
 static int vidioc_querybuf(struct file *file, void *priv, struct v4l2_buffer *p)
 {
     struct coach_dev  *dev = priv;
-    return (videobuf_querybuf(&dev->vb_vidq, p));
+    return (vb2_querybuf(&dev->vb_vidq, p));
+}
+
+static int vidioc_prepare_buf(struct file *file, void *priv, struct v4l2_buffer *p)
+{
+    struct coach_dev *dev = priv;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+    return (vb2_prepare_buf(&dev->vb_vidq, NULL, p));
+#else
+    return (vb2_prepare_buf(&dev->vb_vidq, p));
+#endif
 }
 
 static int vidioc_qbuf(struct file *file, void *priv, struct v4l2_buffer *p)
 {
     struct coach_dev *dev = priv;
-    return (videobuf_qbuf(&dev->vb_vidq, p));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+    return (vb2_qbuf(&dev->vb_vidq, NULL, p));
+#else
+    return (vb2_qbuf(&dev->vb_vidq, p));
+#endif
 }
 
 static int vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *p)
 {
     struct coach_dev  *dev = priv;
-    return (videobuf_dqbuf(&dev->vb_vidq, p, file->f_flags & O_NONBLOCK));
+    return (vb2_dqbuf(&dev->vb_vidq, p, file->f_flags & O_NONBLOCK));
 }
 
-#ifdef CONFIG_VIDEO_V4L1_COMPAT
-static int vidiocgmbuf(struct file *file, void *priv, struct video_mbuf *mbuf)
+/* a buffer as a dma-buf file descriptor, for the encoder */
+static int vidioc_expbuf(struct file *file, void *priv, struct v4l2_exportbuffer *p)
 {
     struct coach_dev  *dev = priv;
-    return videobuf_cgmbuf(&dev->vb_vidq, mbuf, 8);
+    return (vb2_expbuf(&dev->vb_vidq, p));
 }
-#endif
 
 static int vidioc_streamon(struct file *file, void *priv, enum v4l2_buf_type i)
 {
@@ -905,9 +1037,8 @@ static int vidioc_streamon(struct file *file, void *priv, enum v4l2_buf_type i)
     if (i != dev->type)
         return -EINVAL;
 
-    zr364xx_start_readpipe(dev);
-    zr364xx_start_acquire(dev);
-    return videobuf_streamon(&dev->vb_vidq);
+    /* start_streaming() starts the read pipe */
+    return vb2_streamon(&dev->vb_vidq, i);
 }
 
 static int vidioc_streamoff(struct file *file, void *priv, enum v4l2_buf_type i)
@@ -921,11 +1052,8 @@ static int vidioc_streamoff(struct file *file, void *priv, enum v4l2_buf_type i)
     if(dev->removed)
         return -EINVAL;
 
-    if (dev->b_acquire)
-        zr364xx_stop_acquire(dev);
-
-    zr364xx_stop_readpipe(dev);
-    return videobuf_streamoff(&dev->vb_vidq);
+    /* stop_streaming() stops the read pipe */
+    return vb2_streamoff(&dev->vb_vidq, i);
 }
 
 static int vidioc_s_std(struct file *file, void *priv, v4l2_std_id i)
@@ -1076,16 +1204,6 @@ static int coach_open(struct file *file)
     dev->width    = 320;
     dev->height   = 240;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
-    videobuf_queue_vmalloc_init(&dev->vb_vidq, &coach_video_qops,
-            NULL, &dev->slock, dev->type, V4L2_FIELD_INTERLACED,
-            sizeof(struct coach_buffer), dev, NULL);
-#else
-    videobuf_queue_vmalloc_init(&dev->vb_vidq, &coach_video_qops,
-            NULL, &dev->slock, dev->type, V4L2_FIELD_INTERLACED,
-            sizeof(struct coach_buffer), dev);
-#endif
-
     /* Added some delay here, since opening/closing the camera quickly,
      * like Ekiga does during its startup, can crash the webcam
      */
@@ -1098,6 +1216,7 @@ static ssize_t
 coach_read(struct file *file, char __user *data, size_t count, loff_t *ppos)
 {
     struct coach_dev *dev = file->private_data;
+    ssize_t ret = 0;
 
     dprintk(dev, 1, "%s\n", __func__);
     if (!data)
@@ -1107,16 +1226,19 @@ coach_read(struct file *file, char __user *data, size_t count, loff_t *ppos)
         return -EINVAL;
 
     if (dev->type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
-        return videobuf_read_stream(&dev->vb_vidq, data, count, ppos, 0,
+        if (mutex_lock_interruptible(&dev->queue_lock))
+            return -ERESTARTSYS;
+        ret = vb2_read(&dev->vb_vidq, data, count, ppos,
                 file->f_flags & O_NONBLOCK);
+        mutex_unlock(&dev->queue_lock);
     }
-    return 0;
+    return ret;
 }
 
 static unsigned int coach_poll(struct file *file, struct poll_table_struct *wait)
 {
     struct coach_dev      *dev = file->private_data;
-    struct videobuf_queue *q = &dev->vb_vidq;
+    unsigned int res;
 
     dprintk(dev, 1, "%s\n", __func__);
 
@@ -1125,7 +1247,11 @@ static unsigned int coach_poll(struct file *file, struct poll_table_struct *wait
     if(dev->removed)
         return POLLERR;
 
-    return videobuf_poll_stream(file, q, wait);
+    /* vb2_poll may start streaming for read() */
+    mutex_lock(&dev->queue_lock);
+    res = vb2_poll(&dev->vb_vidq, file, wait);
+    mutex_unlock(&dev->queue_lock);
+    return res;
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 31)
@@ -1140,8 +1266,10 @@ static int coach_close(struct file *file)
 
     dprintk(dev, 1, "%s\n", __func__);
 
-    videobuf_stop(&dev->vb_vidq);
-    videobuf_mmap_free(&dev->vb_vidq);
+    /* stops streaming and frees the buffers */
+    mutex_lock(&dev->queue_lock);
+    vb2_queue_release(&dev->vb_vidq);
+    mutex_unlock(&dev->queue_lock);
 
     mutex_lock(&dev->mutex);
     dev->users--;
@@ -1163,7 +1291,7 @@ static int coach_mmap(struct file *file, struct vm_area_struct *vma)
 
     dprintk(dev, 1, "%s mmap called, vma=0x%08lx\n", __func__, (unsigned long)vma);
 
-    ret = videobuf_mmap_mapper(&dev->vb_vidq, vma);
+    ret = vb2_mmap(&dev->vb_vidq, vma);
 
     dprintk(dev, 1, "vma start=0x%08lx, size=%ld, ret=%d\n",
             (unsigned long)vma->vm_start,
@@ -1182,83 +1310,156 @@ static int coach_mmap(struct file *file, struct vm_area_struct *vma)
  *
  */
 static void 
-zr364xx_fillbuff(struct coach_dev *cam, struct coach_buffer *buf, int jpgsize)
+zr364xx_fillbuff(struct coach_dev *cam, struct coach_buffer *buf,
+        struct zr364xx_framei *frm)
 {
-    int pos = 0;
-    struct timeval ts;
-    const char *tmpbuf;
-    char *vbuf = videobuf_to_vmalloc(&buf->vb);
-    unsigned long last_frame;
-    struct zr364xx_framei *frm;
+    const char *tmpbuf = frm->lpvbits;
+    char *vbuf = vb2_plane_vaddr(&buf->vb.vb2_buf, 0);
+    enum vb2_buffer_state state = VB2_BUF_STATE_DONE;
 
-    if (!vbuf)
-        return;
+    if (!vbuf || frm->cur_size > vb2_plane_size(&buf->vb.vb2_buf, 0)) {
+        state = VB2_BUF_STATE_ERROR;
+        goto done;
+    }
 
-    last_frame = cam->last_frame;
-    if (last_frame != -1) {
-        frm = &cam->buffer.frame[last_frame];
-        tmpbuf = (const char *)cam->buffer.frame[last_frame].lpvbits;
-        switch (buf->fmt->fourcc) {
-            case V4L2_PIX_FMT_JPEG:
-            case V4L2_PIX_FMT_MJPEG:
-                buf->vb.size = jpgsize;
-                memcpy(vbuf, tmpbuf, buf->vb.size);
-                break;
-            default:
-                printk(KERN_DEBUG KBUILD_MODNAME ": unknown format?\n");
-        }
-        cam->last_frame = -1;
-    } else {
-        printk(KERN_ERR KBUILD_MODNAME ": ======= no frame\n");
-        return;
+    switch (buf->fmt->fourcc) {
+        case V4L2_PIX_FMT_JPEG:
+        case V4L2_PIX_FMT_MJPEG:
+            vb2_set_plane_payload(&buf->vb.vb2_buf, 0, frm->cur_size);
+            memcpy(vbuf, tmpbuf, frm->cur_size);
+            break;
+        default:
+            printk(KERN_DEBUG KBUILD_MODNAME ": unknown format?\n");
     }
-    DBG("%s: Buffer 0x%08lx size= %d\n", __func__, (unsigned long)vbuf, pos);
-    /* tell v4l buffer was filled */
+    DBG("%s: Buffer 0x%08lx size= %lu\n", __func__, (unsigned long)vbuf, frm->cur_size);
 
-    buf->vb.field_count = cam->frame_count * 2;
-    do_gettimeofday(&ts);
-    buf->vb.ts = ts;
-    buf->vb.state = VIDEOBUF_DONE;
+done:
+    /* tell v4l buffer was filled */
+    buf->vb.vb2_buf.timestamp = frm->timestamp;
+    buf->vb.sequence = frm->sequence;
+    buf->vb.field = V4L2_FIELD_NONE;
+    vb2_buffer_done(&buf->vb.vb2_buf, state);
+    DBG("wakeup [buf/i] [%p/%d]\n", buf, buf->vb.vb2_buf.index);
 }
 
-static int 
-zr364xx_got_frame(struct coach_dev *cam, int jpgsize)
+/* hand the ready frames to the queued buffers, oldest first (cam->slock held) */
+static void zr364xx_flush_frames(struct coach_dev *cam)
 {
     struct coach_dmaqueue *dma_q = &cam->vidq;
+    struct coach_bufferi *ring = &cam->buffer;
+    struct zr364xx_framei *frm;
     struct coach_buffer *buf;
-    unsigned long flags = 0;
-    int rc = 0;
 
-    DBG("wakeup: %p\n", &dma_q);
+    if (!cam->b_acquire)
+        return;
 
-    spin_lock_irqsave(&cam->slock, flags);
+    /* head + ready, the frame being assembled, does not move */
+    while (ring->ready && !list_empty(&dma_q->active)) {
+        buf = list_first_entry(&dma_q->active, struct coach_buffer, list);
+        list_del(&buf->list);
+
+        frm = &ring->frame[ring->head];
+        zr364xx_fillbuff(cam, buf, frm);
+        frm->ulState = ZR364XX_READ_IDLE;
+        frm->cur_size = 0;
 
-    if (list_empty(&dma_q->active)) {
-        DBG("No active queue to serve\n");
-        rc = -1;
-        goto unlock;
+        ring->head = (ring->head + 1) % ring->dwFrames;
+        ring->ready--;
     }
-    buf = list_entry(dma_q->active.next,
-            struct coach_buffer, vb.queue);
+}
 
-    if (!waitqueue_active(&buf->vb.done)) {
-        /* no one active */
-        rc = -1;
-        goto unlock;
+/* the staging frame is complete: keep it for the reader (cam->slock held) */
+static void zr364xx_stage_frame(struct coach_dev *cam)
+{
+    struct coach_bufferi *ring = &cam->buffer;
+    struct zr364xx_framei *frm = &ring->frame[cam->cur_frame];
+
+    frm->ulState = ZR364XX_READ_READY;
+    frm->sequence = cam->frame_count;
+    frm->timestamp = ktime_get_ns();
+    ring->ready++;
+    zr364xx_flush_frames(cam);
+
+    if (ring->ready == ring->dwFrames) {
+        /* no frame left to assemble the next one in: drop the oldest */
+        frm = &ring->frame[ring->head];
+        DBG("frame %u dropped, %lu so far\n", frm->sequence, ring->dropped + 1);
+        frm->ulState = ZR364XX_READ_IDLE;
+        frm->cur_size = 0;
+        ring->head = (ring->head + 1) % ring->dwFrames;
+        ring->ready--;
+        ring->dropped++;
     }
-    list_del(&buf->vb.queue);
+    cam->cur_frame = (ring->head + ring->ready) % ring->dwFrames;
+}
+
+/* take the next queued buffer to assemble the frame in (cam->slock held) */
+static void zr364xx_reserve_buffer(struct coach_dev *cam)
+{
+    struct coach_dmaqueue *dma_q = &cam->vidq;
+    struct coach_buffer *buf;
 
-    do_gettimeofday(&buf->vb.ts);
+    if (list_empty(&dma_q->active))
+        return;
+    buf = list_first_entry(&dma_q->active, struct coach_buffer, list);
+    if (!vb2_plane_vaddr(&buf->vb.vb2_buf, 0))
+        return;
 
-    /* Fill buffer */
-    zr364xx_fillbuff(cam, buf, jpgsize);
-    DBG("filled buffer %p\n", buf);
+    list_del(&buf->list);
+    cam->cur_buf = buf;
+    /* USERPTR and DMABUF planes may be larger than the format asks for */
+    cam->cur_buf_size = vb2_plane_size(&buf->vb.vb2_buf, 0);
+}
 
-    wake_up(&buf->vb.done);
-    DBG("wakeup [buf/i] [%p/%d]\n", buf, buf->vb.i);
-unlock:
-    spin_unlock_irqrestore(&cam->slock, flags);
-    return rc;
+/* give the reserved buffer back to the queue for the next frame (cam->slock held) */
+static void zr364xx_requeue_buffer(struct coach_dev *cam)
+{
+    struct coach_buffer *buf = cam->cur_buf;
+
+    if (!buf)
+        return;
+    list_add(&buf->list, &cam->vidq.active);
+    cam->cur_buf = NULL;
+}
+
+/* the frame assembled in the reserved buffer is complete (cam->slock held) */
+static void zr364xx_complete_buffer(struct coach_dev *cam, int jpgsize)
+{
+    struct coach_buffer *buf = cam->cur_buf;
+
+    vb2_set_plane_payload(&buf->vb.vb2_buf, 0, jpgsize);
+    buf->vb.vb2_buf.timestamp = ktime_get_ns();
+    buf->vb.sequence = cam->frame_count;
+    buf->vb.field = V4L2_FIELD_NONE;
+    cam->cur_buf = NULL;
+
+    vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+    DBG("wakeup [buf/i] [%p/%d]\n", buf, buf->vb.vb2_buf.index);
+}
+
+/*
+ * Look for the markers in the bytes copied to the frame since it held
+ * 'from' bytes: the EOI (FF D9 FF) and the junk (FF FF FF) some frames
+ * have in the middle of the picture.  A marker may start in the 2 bytes
+ * before, so the end of the frame needs no scan of its own.
+ */
+static void zr364xx_scan_markers(struct zr364xx_framei *frm,
+        const unsigned char *frame, unsigned long from)
+{
+    const unsigned char *p, *end;
+
+    if (frm->cur_size < 3)
+        return;
+    p = frame + (from > 2 ? from - 2 : 0);
+    end = frame + frm->cur_size - 2;	/* past the last 3-byte marker */
+
+    while (p < end && (p = memchr(p, 0xFF, end - p)) != NULL) {
+        if (p[1] == 0xD9 && p[2] == 0xFF)
+            frm->eoi = p - frame;
+        else if (p[1] == 0xFF && p[2] == 0xFF && frm->junk < 0 && p > frame)
+            frm->junk = p - frame;
+        p++;
+    }
 }
 
 /* this function moves the usb stream read pipe data
@@ -1266,6 +1467,11 @@ unlock:
  * returns 0 on success, EAGAIN if more data to process (call this
  * function again).
  *
+ * The frame goes straight into the next queued vb2 buffer; a staging
+ * frame of cam->buffer is used when none is queued at its start, and
+ * kept until the reader queues one.
+ * stop_streaming() kills the urbs before it takes the buffers back.
+ *
  * Source: zr364xx.c
  */
 static int zr364xx_read_video_callback(struct coach_dev *cam,
@@ -1275,9 +1481,17 @@ static int zr364xx_read_video_callback(struct coach_dev *cam,
     unsigned char *pdest;
     unsigned char *psrc;
     unsigned char *ptr = NULL;
+    unsigned char *frame;
     struct zr364xx_framei *frm;
+    unsigned long limit;
+    unsigned long from;
+    unsigned long flags = 0;
+    int start = 0;
     s32 idx = -1;
 
+    spin_lock_irqsave(&cam->slock, flags);
+
+    /* cur_frame moves on under slock when a frame completes */
     idx = cam->cur_frame;
     frm = &cam->buffer.frame[idx];
 
@@ -1285,16 +1499,53 @@ static int zr364xx_read_video_callback(struct coach_dev *cam,
     if (!cam->b_acquire) {
         /* we found a frame, but this channel is turned off */
         frm->ulState = ZR364XX_READ_IDLE;
+        zr364xx_requeue_buffer(cam);
+        spin_unlock_irqrestore(&cam->slock, flags);
         return -EINVAL;
     }
 
+    if (cam->resync) {
+        /* drop the frame; the next one starts after a short transfer */
+        frm->ulState = ZR364XX_READ_IDLE;
+        frm->cur_size = 0;
+        zr364xx_requeue_buffer(cam);
+        if (purb->actual_length < pipe_info->transfer_size)
+            cam->resync = 0;
+        spin_unlock_irqrestore(&cam->slock, flags);
+        return 0;
+    }
+
     psrc = (u8 *)pipe_info->transfer_buffer;
-    ptr = pdest = frm->lpvbits;
 
     if (frm->ulState == ZR364XX_READ_IDLE) {
+        if (purb->actual_length < 128) {
+            /* a frame starts with the two quantization tables */
+            DBG("%s: short frame start (%d bytes)\n", __func__, purb->actual_length);
+            spin_unlock_irqrestore(&cam->slock, flags);
+            return 0;
+        }
         frm->ulState = ZR364XX_READ_FRAME;
         frm->cur_size = 0;
+        frm->eoi = -1;
+        frm->junk = -1;
+        frm->overflow = 0;
+        /* frames kept for a late reader go before this one */
+        zr364xx_flush_frames(cam);
+        zr364xx_reserve_buffer(cam);
+        start = 1;
+    }
+
+    if (cam->cur_buf) {
+        pdest = vb2_plane_vaddr(&cam->cur_buf->vb.vb2_buf, 0);
+        limit = min_t(unsigned long, cam->cur_buf_size, MAX_FRAME_SIZE);
+    } else {
+        pdest = frm->lpvbits;
+        limit = MAX_FRAME_SIZE;
+    }
+    ptr = frame = pdest;
+    from = frm->cur_size;
 
+    if (start) {
         memcpy( &JFIF_HEADER[OFFSET_OF_QTABLE_0], psrc, 64 );
         memcpy( &JFIF_HEADER[OFFSET_OF_QTABLE_1], psrc + 64, 64 );
 
@@ -1303,64 +1554,63 @@ static int zr364xx_read_video_callback(struct coach_dev *cam,
         JFIF_HEADER[OFFSET_OF_FRAME_WIDTH+0]	= (cam->width >> 8) & 0xFF;
         JFIF_HEADER[OFFSET_OF_FRAME_WIDTH+1]	= cam->width & 0xFF;
 
-        memcpy( ptr, JFIF_HEADER, LENGTH_OF_JFIF_HEADER );
+        if (LENGTH_OF_JFIF_HEADER + purb->actual_length - 128 > limit) {
+            dev_info(&cam->udev->dev, "%s: buffer (%lu bytes) too small to hold " "frame data. Discarding frame data.\n", __func__, limit);
+            frm->overflow = 1;
+        } else {
+            memcpy( ptr, JFIF_HEADER, LENGTH_OF_JFIF_HEADER );
 
-        ptr += LENGTH_OF_JFIF_HEADER;
-        memcpy(ptr, psrc + 128, purb->actual_length - 128);
-        ptr += purb->actual_length - 128;
-        frm->cur_size = ptr - pdest;
-    } else {
-        if (frm->cur_size + purb->actual_length > MAX_FRAME_SIZE) {
-            dev_info(&cam->udev->dev, "%s: buffer (%d bytes) too small to hold " "frame data. Discarding frame data.\n", __func__, MAX_FRAME_SIZE);
+            ptr += LENGTH_OF_JFIF_HEADER;
+            memcpy(ptr, psrc + 128, purb->actual_length - 128);
+            ptr += purb->actual_length - 128;
+            frm->cur_size = ptr - pdest;
+        }
+    } else if (!frm->overflow) {
+        if (frm->cur_size + purb->actual_length > limit) {
+            dev_info(&cam->udev->dev, "%s: buffer (%lu bytes) too small to hold " "frame data. Discarding frame data.\n", __func__, limit);
+            frm->overflow = 1;
         } else {
             pdest += frm->cur_size;
             memcpy(pdest, psrc, purb->actual_length);
             frm->cur_size += purb->actual_length;
         }
     }
+    zr364xx_scan_markers(frm, frame, from);
 
     if (purb->actual_length < pipe_info->transfer_size) {
         _DBG("****************Buffer[%d]full*************\n", idx);
-        cam->last_frame = cam->cur_frame;
-        cam->cur_frame++;
-        /* end of system frame ring buffer, start at zero */
-        if (cam->cur_frame == cam->buffer.dwFrames)
-            cam->cur_frame = 0;
 
         /* frame ready */
-        /* go back to find the JPEG EOI marker */
-        ptr = pdest = frm->lpvbits;
-        ptr += frm->cur_size - 2;
-        while (ptr > pdest) {
-            if (*ptr == 0xFF && *(ptr + 1) == 0xD9 && *(ptr + 2) == 0xFF)
-                break;
-            ptr--;
-        }
-        if (ptr == pdest)
+        if (frm->eoi < 0)
             DBG("No EOI marker\n");
 
         /* Sometimes there is junk data in the middle of the picture,
          * we want to skip this bogus frames */
-        while (ptr > pdest) {
-            if (*ptr == 0xFF && *(ptr + 1) == 0xFF
-                    && *(ptr + 2) == 0xFF)
-                break;
-            ptr--;
-        }
-        if (ptr != pdest) {
+        if (frm->overflow) {
+            /* a JPEG with a hole: the buffer goes back for the next frame */
+            DBG("Truncated frame %lu\n", cam->frame_count);
+            zr364xx_requeue_buffer(cam);
+        } else if (frm->junk >= 0 && frm->junk < frm->eoi) {
             DBG("Bogus frame ? %d\n", ++(cam->nb));
-        } else if (cam->b_acquire) {
+            zr364xx_requeue_buffer(cam);
+        } else if (cam->skip) {
             /* we skip the 2 first frames which are usually buggy */
-            if (cam->skip)
-                cam->skip--;
-            else {
-                zr364xx_got_frame(cam, frm->cur_size);
-            }
+            cam->skip--;
+            zr364xx_requeue_buffer(cam);
+        } else if (cam->cur_buf) {
+            zr364xx_complete_buffer(cam, frm->cur_size);
+        } else {
+            /* moves cur_frame on to the next staging frame */
+            zr364xx_stage_frame(cam);
+            frm = NULL;
         }
         cam->frame_count++;
-        frm->ulState = ZR364XX_READ_IDLE;
-        frm->cur_size = 0;
+        if (frm) {
+            frm->ulState = ZR364XX_READ_IDLE;
+            frm->cur_size = 0;
+        }
     }
+    spin_unlock_irqrestore(&cam->slock, flags);
     /* done successfully */
     return 0;
 }
@@ -1403,9 +1653,19 @@ read_pipe_completion(struct urb *purb)
         return;
     }
 
+    if (pipe_info->seq != cam->read_seq) {
+        /* the usb core completes the urbs of an endpoint in order;
+         * if not, the data of the frame being assembled is mixed up */
+        DBG("%s: urb %u completed, %u expected\n", __func__, pipe_info->seq, cam->read_seq);
+        cam->resync = 1;
+    }
+    cam->read_seq = pipe_info->seq + 1;
+
     if (purb->status == 0) {
         zr364xx_read_video_callback(cam, pipe_info, purb);
     } else {
+        /* a hole in the frame */
+        cam->resync = 1;
         pipe_info->err_count++;
         DBG("%s: failed URB %d\n", __func__, purb->status);
     }
@@ -1420,6 +1680,7 @@ read_pipe_completion(struct urb *purb)
             read_pipe_completion, pipe_info);
 
     if (pipe_info->state != 0) {
+        pipe_info->seq = cam->submit_seq++;
         purb->status = usb_submit_urb(pipe_info->stream_urb, GFP_ATOMIC);
 
         if (purb->status)
@@ -1455,9 +1716,12 @@ static const struct v4l2_ioctl_ops coach_ioctl_ops = {
     .vidioc_try_fmt_vid_cap   = vidioc_try_fmt_vid_cap,
     .vidioc_s_fmt_vid_cap     = vidioc_s_fmt_vid_cap,
     .vidioc_reqbufs           = vidioc_reqbufs,
+    .vidioc_create_bufs       = vidioc_create_bufs,
     .vidioc_querybuf          = vidioc_querybuf,
+    .vidioc_prepare_buf       = vidioc_prepare_buf,
     .vidioc_qbuf              = vidioc_qbuf,
     .vidioc_dqbuf             = vidioc_dqbuf,
+    .vidioc_expbuf            = vidioc_expbuf,
     .vidioc_s_std             = vidioc_s_std,
     .vidioc_enum_input        = vidioc_enum_input,
     .vidioc_g_input           = vidioc_g_input,
@@ -1467,9 +1731,6 @@ static const struct v4l2_ioctl_ops coach_ioctl_ops = {
     .vidioc_s_ctrl            = vidioc_s_ctrl,
     .vidioc_streamon          = vidioc_streamon,
     .vidioc_streamoff         = vidioc_streamoff,
-#ifdef CONFIG_VIDEO_V4L1_COMPAT
-    .vidiocgmbuf              = vidiocgmbuf,
-#endif
 };
 #endif
 
@@ -1500,37 +1761,56 @@ static struct video_device coach_template = {
     .vidioc_s_ctrl            = vidioc_s_ctrl,
     .vidioc_streamon          = vidioc_streamon,
     .vidioc_streamoff         = vidioc_streamoff,
-#ifdef CONFIG_VIDEO_V4L1_COMPAT
-    .vidiocgmbuf              = vidiocgmbuf,
-#endif
 #endif
 };
 
 /* -----------------------------------------------------------------
 	Initialization and module stuff
    ------------------------------------------------------------------*/
+static void coach_free_pipes(struct coach_dev *cam)
+{
+    int i;
+
+    for (i = 0; i < cam->nr_pipes; i++) {
+        kfree(cam->pipe[i].transfer_buffer);
+        cam->pipe[i].transfer_buffer = NULL;
+    }
+}
+
 static int coach_board_init(struct coach_dev *cam)
 {
-    struct coach_pipeinfo *pipe = cam->pipe;
+    struct coach_pipeinfo *pipe;
     unsigned long i;
     uint16_t mode[2];
+    u32 transfer_size;
 
     DBG("board init: %p\n", cam);
-    memset(pipe, 0, sizeof(*pipe));
-    pipe->cam = cam;
-    pipe->transfer_size = BUFFER_SIZE;
 
-    pipe->transfer_buffer = kzalloc(pipe->transfer_size, GFP_KERNEL);
-    if (pipe->transfer_buffer == NULL) {
-        DBG("out of memory!\n");
-        return -ENOMEM;
+    /* a short packet ends a frame, so urbs hold whole packets */
+    transfer_size = roundup(clamp_t(u32, urb_size, cam->read_maxpacket, MAX_FRAME_SIZE),
+            cam->read_maxpacket);
+    cam->nr_pipes = clamp_t(int, urbs, 1, MAX_URBS);
+    for (i = 0; i < cam->nr_pipes; i++) {
+        pipe = &cam->pipe[i];
+        memset(pipe, 0, sizeof(*pipe));
+        pipe->cam = cam;
+        pipe->idx = i;
+        pipe->transfer_size = transfer_size;
+
+        pipe->transfer_buffer = kzalloc(pipe->transfer_size, GFP_KERNEL);
+        if (pipe->transfer_buffer == NULL) {
+            DBG("out of memory!\n");
+            coach_free_pipes(cam);
+            return -ENOMEM;
+        }
     }
 
     cam->b_acquire = 0;
     cam->frame_count = 0;
 
     /*** start create system buffers ***/
-    for (i = 0; i < FRAMES; i++) {
+    /* one more than the frames kept, to assemble the next frame in */
+    for (i = 0; i < clamp_t(unsigned, frames, 1, MAX_FRAMES) + 1; i++) {
         /* always allocate maximum size for system buffers */
         cam->buffer.frame[i].lpvbits = vmalloc(MAX_FRAME_SIZE);
 
@@ -1544,22 +1824,25 @@ static int coach_board_init(struct coach_dev *cam)
         }
     }
 
-    if (i == 0) {
+    if (i < 2) {
         printk(KERN_INFO KBUILD_MODNAME ": out of memory. Aborting\n");
-        kfree(cam->pipe->transfer_buffer);
-        cam->pipe->transfer_buffer = NULL;
+        if (i)
+            vfree(cam->buffer.frame[0].lpvbits);
+        cam->buffer.frame[0].lpvbits = NULL;
+        coach_free_pipes(cam);
         return -ENOMEM;
     } else
         cam->buffer.dwFrames = i;
 
     /* make sure internal states are set */
-    for (i = 0; i < FRAMES; i++) {
+    for (i = 0; i < cam->buffer.dwFrames; i++) {
         cam->buffer.frame[i].ulState = ZR364XX_READ_IDLE;
         cam->buffer.frame[i].cur_size = 0;
     }
 
     cam->cur_frame = 0;
-    cam->last_frame = -1;
+    cam->buffer.head = 0;
+    cam->buffer.ready = 0;
     /*** end create system buffers ***/
 
     /* start read pipe */
@@ -1627,6 +1910,7 @@ static int coach_probe(struct usb_interface *intf,
     /* initialize locks */
     mutex_init(&cam->mutex);
     mutex_init(&cam->open_lock);
+    mutex_init(&cam->queue_lock);
 
     // set up the endpoint information
     iface_desc = intf->cur_altsetting;
@@ -1636,10 +1920,11 @@ static int coach_probe(struct usb_interface *intf,
         if (!cam->read_endpoint && usb_endpoint_is_bulk_in(endpoint)) {
             // we found the bulk in endpoint 
             cam->read_endpoint = endpoint->bEndpointAddress;
+            cam->read_maxpacket = le16_to_cpu(endpoint->wMaxPacketSize) & 0x7ff;
         }
     }
 
-    if (!cam->read_endpoint) {
+    if (!cam->read_endpoint || !cam->read_maxpacket) {
         dev_err(&intf->dev, "Could not find bulk-in endpoint\n");
         return -ENOMEM;
     }
@@ -1648,9 +1933,50 @@ static int coach_probe(struct usb_interface *intf,
     INIT_LIST_HEAD(&cam->vidq.active);
 
     cam->vidq.cam = cam;
+    cam->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam->fmt = &formats[0];
+    cam->width = 320;
+    cam->height = 240;
+
+    /* vb2 queue: mmap, user pointers and dma-buf import/export */
+    cam->vb_vidq.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam->vb_vidq.io_modes = VB2_MMAP | VB2_USERPTR | VB2_DMABUF | VB2_READ;
+    cam->vb_vidq.drv_priv = cam;
+    cam->vb_vidq.buf_struct_size = sizeof(struct coach_buffer);
+    cam->vb_vidq.ops = &coach_video_qops;
+    cam->vb_vidq.mem_ops = &vb2_vmalloc_memops;
+    cam->vb_vidq.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    cam->vb_vidq.lock = &cam->queue_lock;
+    cam->vb_vidq.dev = &intf->dev;
+    err = vb2_queue_init(&cam->vb_vidq);
+    if (err) {
+        dev_err(&udev->dev, "vb2_queue_init failed\n");
+        video_device_release(cam->vfd);
+        kfree(cam);
+        return err;
+    }
+
+    err = v4l2_device_register(&intf->dev, &cam->v4l2_dev);
+    if (err) {
+        dev_err(&udev->dev, "v4l2_device_register failed\n");
+        video_device_release(cam->vfd);
+        kfree(cam);
+        return err;
+    }
+    cam->vfd->v4l2_dev = &cam->v4l2_dev;
+    cam->vfd->queue = &cam->vb_vidq;
+    cam->vfd->lock = &cam->queue_lock;
+    cam->vfd->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING |
+        V4L2_CAP_READWRITE;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+    err = video_register_device(cam->vfd, VFL_TYPE_VIDEO, -1);
+#else
     err = video_register_device(cam->vfd, VFL_TYPE_GRABBER, -1);
+#endif
     if (err) {
         dev_err(&udev->dev, "video_register_device failed\n");
+        v4l2_device_unregister(&cam->v4l2_dev);
         video_device_release(cam->vfd);
         kfree(cam);
         cam = NULL;
@@ -1701,19 +2027,23 @@ static void coach_destroy(struct coach_dev *dev)
 
     if(dev->removed == 0)
         zr364xx_stop_readpipe(dev);
+    else
+        zr364xx_kill_urbs(dev);
 
     if (dev->vfd)
         video_unregister_device(dev->vfd);
     dev->vfd = NULL;
+    v4l2_device_unregister(&dev->v4l2_dev);
 
     /* release sys buffers */
-    for (i = 0; i < FRAMES; i++) {
+    for (i = 0; i < MAX_FRAMES + 1; i++) {
         if (dev->buffer.frame[i].lpvbits) {
             DBG("vfree %p\n", dev->buffer.frame[i].lpvbits);
             vfree(dev->buffer.frame[i].lpvbits);
         }
         dev->buffer.frame[i].lpvbits = NULL;
     }
+    coach_free_pipes(dev);
 
     mutex_unlock(&dev->open_lock);
     kfree(dev);
@@ -14,6 +14,8 @@
 
 #include <linux/cdev.h>
 #include <linux/ioctl.h>
+#include <linux/uaccess.h>
+#include <linux/compat.h>       /* for 32bit compatibility */
 
 #include "fakemouse.h"
 
@@ -26,6 +28,9 @@
 #define WARN(X) printk(KERN_WARNING stringify( MODNAME ) ":" X "!\n");
 
 static long fakemouse_ioctl(struct file *filp,unsigned int command, unsigned long arg);
+#ifdef CONFIG_COMPAT
+static long fakemouse_compat_ioctl(struct file *filp,unsigned int command, unsigned long arg);
+#endif
 static int fakemouse_device_open(struct inode *inode, struct file *filp);
 static int fakemouse_device_release(struct inode *inode, struct file *filp);
 
@@ -36,7 +41,9 @@ struct file_operations fakemouse_fops =
     .llseek  = 0,
     .read    = 0,
     .write   = 0,
-    .compat_ioctl   = fakemouse_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl   = fakemouse_compat_ioctl,
+#endif
     .open    = fakemouse_device_open,
     .release = fakemouse_device_release,
   };
@@ -48,13 +55,19 @@ struct file_operations fakemouse_fops =
     .read    = 0,
     .write   = 0,
     .unlocked_ioctl   = fakemouse_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl   = fakemouse_compat_ioctl,
+#endif
     .open    = fakemouse_device_open,
     .release = fakemouse_device_release,
   };
 #endif
 
 
-int lsadrv_ioctl_mouseevent_dispatch(void *arg);
+struct lsadrv_input_dev;
+extern struct lsadrv_input_dev *lsadrv_idev;
+int lsadrv_ioctl_mouseevent_dispatch(struct lsadrv_input_dev *xidev, void *arg);
+int lsadrv_ioctl_inputevents_dispatch(struct lsadrv_input_dev *xidev, const struct lsadrv_input_events *events);
 
 static long fakemouse_ioctl(struct file *filp,unsigned int command, unsigned long arg)
 {
@@ -66,13 +79,51 @@ static long fakemouse_ioctl(struct file *filp,unsigned int command, unsigned lon
     {
     case FAKEMOUSE_IOC_MOUSEEVENT:
       /*      printk("FAKEMOUSE_IOC_MOUSEEVENT: (%d,%d,0x%x)\n", minp->dx, minp->dy, minp->flags);*/
-      lsadrv_ioctl_mouseevent_dispatch((void*)arg);
+      lsadrv_ioctl_mouseevent_dispatch(lsadrv_idev, (void*)arg);
       return 0;
+    case FAKEMOUSE_IOC_INPUTEVENTS:
+      {
+        struct lsadrv_input_events events;
+        if (copy_from_user(&events, (void __user *)arg, sizeof(events)))
+          return -EFAULT;
+        return lsadrv_ioctl_inputevents_dispatch(lsadrv_idev, &events);
+      }
     default:
       return -ENOTTY;
     }
 }
 
+#ifdef CONFIG_COMPAT
+/* 32bit compatibility: the batch holds a user pointer */
+struct compat_fakemouse_input_events
+{
+  unsigned int Count;
+  compat_caddr_t Records; /* (struct lsadrv_input_record *) */
+} __attribute__ ((packed));
+
+#define FAKEMOUSE_IOC_INPUTEVENTS32 _IOW(FAKEMOUSE_MAGIC,FAKEMOUSE_IOCTL_BASE+1,struct compat_fakemouse_input_events)
+
+static long fakemouse_compat_ioctl(struct file *filp,unsigned int command, unsigned long arg)
+{
+  switch(command)
+    {
+    case FAKEMOUSE_IOC_INPUTEVENTS32:
+      {
+        struct compat_fakemouse_input_events ua32;
+        struct lsadrv_input_events events;
+        if (copy_from_user(&ua32, compat_ptr(arg), sizeof(ua32)))
+          return -EFAULT;
+        events.Count = ua32.Count;
+        events.Records = compat_ptr(ua32.Records);
+        return lsadrv_ioctl_inputevents_dispatch(lsadrv_idev, &events);
+      }
+    default:
+      /* the other commands have the same layout */
+      return fakemouse_ioctl(filp, command, (unsigned long)compat_ptr(arg));
+    }
+}
+#endif
+
 static int fakemouse_device_open(struct inode *inode, struct file *filp)
 {
   return 0;
@@ -9,5 +9,6 @@ int create_fakemouse(void);
 #define FAKEMOUSE_MAGIC 'h'
 #define FAKEMOUSE_IOCTL_BASE 0x80
 #define FAKEMOUSE_IOC_MOUSEEVENT _IOW(FAKEMOUSE_MAGIC,FAKEMOUSE_IOCTL_BASE,struct lsadrv_mouse_input)
+#define FAKEMOUSE_IOC_INPUTEVENTS _IOW(FAKEMOUSE_MAGIC,FAKEMOUSE_IOCTL_BASE+1,struct lsadrv_input_events)
 
 #endif
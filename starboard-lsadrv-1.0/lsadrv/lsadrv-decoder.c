@@ -0,0 +1,206 @@
+/*==========================================================================
+ * lsadrv-decoder.c : in-kernel decoders of the touch sensor stream
+ *
+ * Copyright (C) 2009  eIT Co., Ltd. and Xiroku Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+============================================================================*/
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/input.h>
+
+#include "lsadrv.h"
+#include "lsadrv-decoder.h"
+#include "lsadrv-ioctl.h"
+
+#if LSADRV_INPUT_MT
+#include <linux/input/mt.h>
+#endif
+
+#ifdef PREVENT_MOUSE_DRIVER_MATCH
+#define BTN_LEFT	BTN_TOOL_PEN
+#endif //PREVENT_MOUSE_DRIVER_MATCH
+
+/* registered decoders */
+static LIST_HEAD(decoder_list);
+static DEFINE_MUTEX(decoder_lock);
+
+static struct lsadrv_decoder *find_decoder(const char *name)
+{
+	struct lsadrv_decoder *decoder;
+
+	list_for_each_entry(decoder, &decoder_list, list) {
+		if (strcmp(decoder->name, name) == 0) {
+			return decoder;
+		}
+	}
+	return NULL;
+}
+
+int lsadrv_register_decoder(struct lsadrv_decoder *decoder)
+{
+	int ret = 0;
+
+	if (decoder->name == NULL || decoder->open == NULL ||
+	    decoder->close == NULL || decoder->decode == NULL) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&decoder_lock);
+	if (find_decoder(decoder->name)) {
+		ret = -EBUSY;
+	}
+	else {
+		list_add_tail(&decoder->list, &decoder_list);
+		Info("decoder '%s' registered\n", decoder->name);
+	}
+	mutex_unlock(&decoder_lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(lsadrv_register_decoder);
+
+/* streams hold a reference on the owner module, so none is using it */
+void lsadrv_unregister_decoder(struct lsadrv_decoder *decoder)
+{
+	mutex_lock(&decoder_lock);
+	list_del(&decoder->list);
+	mutex_unlock(&decoder_lock);
+	Info("decoder '%s' unregistered\n", decoder->name);
+}
+EXPORT_SYMBOL_GPL(lsadrv_unregister_decoder);
+
+/* look up a decoder by name and pin its module; NULL if not registered */
+struct lsadrv_decoder *lsadrv_get_decoder(const char *name)
+{
+	struct lsadrv_decoder *decoder;
+
+	mutex_lock(&decoder_lock);
+	decoder = find_decoder(name);
+	if (decoder && !try_module_get(decoder->owner)) {
+		decoder = NULL;
+	}
+	mutex_unlock(&decoder_lock);
+	return decoder;
+}
+
+void lsadrv_put_decoder(struct lsadrv_decoder *decoder)
+{
+	module_put(decoder->owner);
+}
+
+#if LSADRV_INPUT_MT
+/*
+ * a frame on the multi-touch device of the board: MT slots (protocol B)
+ * and the pointer emulation of the oldest contact
+ */
+static void lsadrv_report_mt_contacts(struct input_dev *idev, const struct lsadrv_contact *contacts, int count)
+{
+	struct input_mt_pos pos[LSADRV_DECODER_MAX_CONTACTS];
+	int slots[LSADRV_DECODER_MAX_CONTACTS];
+	int i;
+
+	/* keep each contact in the slot of the nearest one of the last frame */
+	for (i = 0; i < count; i++) {
+		pos[i].x = contacts[i].x;
+		pos[i].y = contacts[i].y;
+	}
+	if (count > 0 && input_mt_assign_slots(idev, slots, pos, count, 0) < 0) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		input_mt_slot(idev, slots[i]);
+		input_mt_report_slot_state(idev, contacts[i].tool, true);
+		input_report_abs(idev, ABS_MT_POSITION_X, clamp(contacts[i].x, 0, 0xffff));
+		input_report_abs(idev, ABS_MT_POSITION_Y, clamp(contacts[i].y, 0, 0xffff));
+		input_report_abs(idev, ABS_MT_PRESSURE, clamp(contacts[i].pressure, 0, 1023));
+	}
+	/* lifts the slots not in this frame, reports ABS_X/ABS_Y/BTN_TOUCH of the oldest contact */
+	input_mt_sync_frame(idev);
+	input_sync(idev);
+}
+#endif
+
+/* a frame as the single pointer of LSADRV_IOC_MOUSEEVENT with absolute coordinates: the first contact */
+static void lsadrv_report_pointer_contact(struct lsadrv_input_dev *xidev, const struct lsadrv_contact *contacts, int count)
+{
+	struct input_dev *idev = xidev->idev;
+
+	if (count > 0) {
+		xidev->mouse_data[0] |= 1;
+		xidev->mouse_data[1] = clamp(contacts[0].x, 0, 0xffff);
+		xidev->mouse_data[2] = clamp(contacts[0].y, 0, 0xffff);
+		input_report_abs(idev, ABS_X, xidev->mouse_data[1]);
+		input_report_abs(idev, ABS_Y, xidev->mouse_data[2]);
+		input_report_abs(idev, ABS_PRESSURE, clamp(contacts[0].pressure, 0, 1023));
+	}
+	else {
+		xidev->mouse_data[0] &= ~1;
+		input_report_abs(idev, ABS_PRESSURE, 0);
+	}
+#ifndef PREVENT_MOUSE_DRIVER_MATCH
+	input_report_key(idev, BTN_TOUCH, count > 0);
+#endif
+	input_report_key(idev, BTN_LEFT, count > 0);
+	input_sync(idev);
+}
+
+/*
+ * report a frame of contacts with a single input_sync: on the touch
+ * device of the board if it has one, else as the pointer of its input
+ * device.  Used by the decoders (urb completion) and LSADRV_IOC_MT_FRAME,
+ * so a frame is emitted under the report_lock of the device.
+ */
+void lsadrv_report_contacts(struct lsadrv_device *xdev, const struct lsadrv_contact *contacts, int count)
+{
+	unsigned long flags;
+
+	count = min(count, LSADRV_DECODER_MAX_CONTACTS);
+
+#if LSADRV_INPUT_MT
+	if (xdev->touch && xdev->touch->idev) {
+		spin_lock_irqsave(&xdev->touch->report_lock, flags);
+		lsadrv_report_mt_contacts(xdev->touch->idev, contacts, count);
+		spin_unlock_irqrestore(&xdev->touch->report_lock, flags);
+		return;
+	}
+#endif
+	if (xdev->xidev && xdev->xidev->idev) {
+		spin_lock_irqsave(&xdev->xidev->report_lock, flags);
+		lsadrv_report_pointer_contact(xdev->xidev, contacts, count);
+		spin_unlock_irqrestore(&xdev->xidev->report_lock, flags);
+	}
+}
+
+/* LSADRV_IOC_MT_FRAME: a frame of contacts found by the user space daemon */
+int lsadrv_report_mt_frame(struct lsadrv_device *xdev, const struct lsadrv_mt_frame *frame)
+{
+	struct lsadrv_contact contacts[LSADRV_MT_MAX_CONTACTS];
+	unsigned int i;
+
+	if (frame->Count > LSADRV_MT_MAX_CONTACTS) {
+		return -EINVAL;
+	}
+	for (i = 0; i < frame->Count; i++) {
+		contacts[i].x = frame->Contacts[i].x;
+		contacts[i].y = frame->Contacts[i].y;
+		contacts[i].pressure = frame->Contacts[i].pressure;
+		contacts[i].tool = (frame->Contacts[i].tool == LSADRV_MT_TOOL_PEN) ? MT_TOOL_PEN : MT_TOOL_FINGER;
+	}
+	lsadrv_report_contacts(xdev, contacts, frame->Count);
+	return 0;
+}
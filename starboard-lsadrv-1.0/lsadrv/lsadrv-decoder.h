@@ -0,0 +1,70 @@
+/*==========================================================================
+ * lsadrv-decoder.h : in-kernel decoders of the touch sensor stream
+ *
+ * Copyright (C) 2009  eIT Co., Ltd. and Xiroku Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+============================================================================*/
+
+#ifndef LSADRV_DECODER_H
+#define LSADRV_DECODER_H
+
+#include <linux/list.h>
+
+struct module;
+
+/* most contacts a decoder can report for one sensor frame */
+#define LSADRV_DECODER_MAX_CONTACTS	10	/* LSADRV_MT_MAX_CONTACTS */
+
+/* a contact found in a sensor frame */
+struct lsadrv_contact {
+	int x;		/* 0..65535, as ABS_X of the lsadrv input device */
+	int y;		/* 0..65535 */
+	int pressure;	/* 0..1023 */
+	int tool;	/* MT_TOOL_FINGER or MT_TOOL_PEN */
+};
+
+/*
+ * A decoder turns the raw isochronous packets of the sensor into
+ * contacts, which lsadrv reports on its input device.  Decoders are
+ * separate modules registering themselves with lsadrv_register_decoder();
+ * the one named by the 'decoder' module parameter of lsadrv is attached to
+ * each stream when it starts.  The packets still go to the stream ring,
+ * so the user space daemon keeps working when no decoder is loaded.
+ */
+struct lsadrv_decoder {
+	const char *name;
+	struct module *owner;
+
+	/* a stream starts: return the decoder's state (NULL on failure) */
+	void *(*open)(unsigned int packetSize);
+	/* the stream is gone */
+	void (*close)(void *state);
+	/*
+	 * one packet of 'length' bytes was received.  Called from the urb
+	 * completion, so it must not sleep.
+	 * return: number of contacts stored in contacts[] when a sensor frame
+	 *         is complete (0: nothing touches); <0: nothing to report yet
+	 */
+	int (*decode)(void *state, const unsigned char *data, unsigned int length,
+		      struct lsadrv_contact *contacts);
+
+	struct list_head list;	/* for lsadrv */
+};
+
+int lsadrv_register_decoder(struct lsadrv_decoder *decoder);
+void lsadrv_unregister_decoder(struct lsadrv_decoder *decoder);
+
+#endif /* LSADRV_DECODER_H */
@@ -19,18 +19,18 @@
  ============================================================================*/
 
 #include <linux/compat.h> 	/* for 32bit compatibility */
-#include <linux/slab.h>		/* for kmalloc */
 
 #include "lsadrv.h"
 #include "lsadrv-ioctl.h"
 #include "lsadrv-vkey.h"
-
-extern struct lsadrv_input_dev *lsadrv_idev;
+#include "lsadrv-trace.h"
 
 /******** static functions and variables ********/
 static int lsadrv_ioctl_get_driver_version(struct lsadrv_device *xdev, void *arg);
 static int lsadrv_ioctl_mouseevent(struct lsadrv_device *xdev, void *arg);
 static int lsadrv_ioctl_keybdevent(struct lsadrv_device *xdev, void *arg);
+static int lsadrv_ioctl_inputevents(struct lsadrv_device *xdev, void *arg);
+static int lsadrv_ioctl_mt_frame(struct lsadrv_device *xdev, void *arg);
 static int lsadrv_ioctl_get_device_descriptor(struct lsadrv_device *xdev, void *arg);
 static int lsadrv_ioctl_get_configuration_descriptor(struct lsadrv_device *xdev, void *arg, int size);
 static int lsadrv_ioctl_get_pipe_info(struct lsadrv_device *xdev, void *arg);
@@ -44,10 +44,30 @@ static int lsadrv_ioctl_reset(struct lsadrv_device *xdev);
 static int lsadrv_ioctl_start_iso_stream(struct lsadrv_device *xdev, void *arg);
 static int lsadrv_ioctl_stop_iso_stream(struct lsadrv_device *xdev);
 static int lsadrv_ioctl_read_iso_buffer(struct lsadrv_device *xdev, void *arg);
+static int lsadrv_ioctl_read_iso_batch(struct lsadrv_device *xdev, void *arg);
 static int lsadrv_ioctl_claim_stream(struct lsadrv_device *xdev, void *arg);
 static int lsadrv_ioctl_check(struct lsadrv_device *xdev, void *arg);
 static int lsadrv_ioctl_get_last_error(struct lsadrv_device *xdev, void *arg);
 static int lsadrv_ioctl_get_current_frame_number(struct lsadrv_device *xdev, void *arg);
+static int lsadrv_ioctl_wait_iso_buffer(struct lsadrv_device *xdev, void *arg);
+static int lsadrv_ioctl_get_iso_dropped(struct lsadrv_device *xdev, void *arg);
+
+/***************************************************************************/
+/* older interfaces */
+
+/* lsadrv_iso_transfer_control before Flags was added (driver 1.2 and before) */
+struct lsadrv_iso_transfer_control_v1
+{
+	unsigned int Pipe;
+	unsigned int PacketSize;
+	unsigned int PacketCount;
+	unsigned int FramesPerBuffer;
+	unsigned int BufferCount;
+};
+
+#define LSADRV_IOC_START_ISO_STREAM_V1		_IOW(LSADRV_IOC_MAGIC, \
+							LSADRV_IOCTL_BASE + 16, \
+							struct lsadrv_iso_transfer_control_v1)
 
 #ifdef CONFIG_COMPAT
 
@@ -92,10 +112,35 @@ struct compat_lsadrv_iso_read_control
 							LSADRV_IOCTL_BASE + 9, \
 							struct compat_lsadrv_bulk_transfer_control)
 
+struct compat_lsadrv_iso_batch_read_control
+{
+	unsigned int PacketSize;
+	unsigned int PacketCount;
+	unsigned int Timeout;
+	unsigned int MinRecords;
+	unsigned int MaxLatency;
+	compat_caddr_t buffer; /* (unsigned char *) */
+	unsigned int  bufferSize;
+} __attribute__ ((packed));
+
 #define LSADRV_IOC_READ_ISO_BUFFER32	_IOW(LSADRV_IOC_MAGIC, \
 							LSADRV_IOCTL_BASE + 18, \
 							struct compat_lsadrv_iso_read_control)
 
+#define LSADRV_IOC_READ_ISO_BATCH32	_IOW(LSADRV_IOC_MAGIC, \
+							LSADRV_IOCTL_BASE + 25, \
+							struct compat_lsadrv_iso_batch_read_control)
+
+struct compat_lsadrv_input_events
+{
+	unsigned int Count;
+	compat_caddr_t Records; /* (struct lsadrv_input_record *) */
+} __attribute__ ((packed));
+
+#define LSADRV_IOC_INPUTEVENTS32	_IOW(LSADRV_IOC_MAGIC, \
+							LSADRV_IOCTL_BASE + 27, \
+							struct compat_lsadrv_input_events)
+
 #endif /* CONFIG_COMPAT */
 
 /***************************************************************************/
@@ -105,15 +150,11 @@ struct compat_lsadrv_iso_read_control
 int lsadrv_usb_ioctl(struct lsadrv_device *xdev, unsigned int cmd, void *arg)
 {
 	int ret = 0;
-	void *karg = NULL;
 
-	lsadrv_modlock(xdev);
 	if (xdev->unplugged) {
-		lsadrv_modunlock(xdev);
 		ret = -ENODEV;
 		goto l_ret;
 	}
-	lsadrv_modunlock(xdev);
 
 	switch (cmd) {
 		/* get driver version */
@@ -177,6 +218,24 @@ int lsadrv_usb_ioctl(struct lsadrv_device *xdev, unsigned int cmd, void *arg)
 			ret = lsadrv_ioctl_start_iso_stream(xdev, arg);
 			break;
 
+		/* start isochronous stream (old structure without Flags) */
+		case LSADRV_IOC_START_ISO_STREAM_V1:
+		{
+			struct lsadrv_iso_transfer_control_v1 *v1 = arg;
+			struct lsadrv_iso_transfer_control a;
+
+			Trace(LSADRV_TRACE_IOCTL, "LSADRV_IOC_START_ISO_STREAM_V1\n");
+			a.Pipe = v1->Pipe;
+			a.PacketSize = v1->PacketSize;
+			a.PacketCount = v1->PacketCount;
+			a.FramesPerBuffer = v1->FramesPerBuffer;
+			a.BufferCount = v1->BufferCount;
+			a.Flags = 0;
+
+			ret = lsadrv_ioctl_start_iso_stream(xdev, &a);
+			break;
+		}
+
 		/* stop isochronous stream */
 		case LSADRV_IOC_STOP_ISO_STREAM:
 			ret = lsadrv_ioctl_stop_iso_stream(xdev);
@@ -212,6 +271,31 @@ int lsadrv_usb_ioctl(struct lsadrv_device *xdev, unsigned int cmd, void *arg)
 			ret = lsadrv_ioctl_keybdevent(xdev, arg);
 			break;
 
+		/* wait until the isochronous stream ring has data */
+		case LSADRV_IOC_WAIT_ISO_BUFFER:
+			ret = lsadrv_ioctl_wait_iso_buffer(xdev, arg);
+			break;
+
+		/* get the number of stream records dropped */
+		case LSADRV_IOC_GET_ISO_DROPPED:
+			ret = lsadrv_ioctl_get_iso_dropped(xdev, arg);
+			break;
+
+		/* read a batch of records from isochronous stream data buffer */
+		case LSADRV_IOC_READ_ISO_BATCH:
+			ret = lsadrv_ioctl_read_iso_batch(xdev, arg);
+			break;
+
+		/* report a multi-touch frame */
+		case LSADRV_IOC_MT_FRAME:
+			ret = lsadrv_ioctl_mt_frame(xdev, arg);
+			break;
+
+		/* send a batch of mouse/keyboard input events */
+		case LSADRV_IOC_INPUTEVENTS:
+			ret = lsadrv_ioctl_inputevents(xdev, arg);
+			break;
+
 #ifdef CONFIG_COMPAT
 		/* 32bit compatibility */
 		/* no need for get_user/put_user here */
@@ -220,22 +304,19 @@ int lsadrv_usb_ioctl(struct lsadrv_device *xdev, unsigned int cmd, void *arg)
 		case LSADRV_IOC_CONTROL32:
 		{
 			struct compat_lsadrv_control_transfer_control *ua32 = arg;
-			struct lsadrv_control_transfer_control *a;
+			struct lsadrv_control_transfer_control a;
 
 			Trace(LSADRV_TRACE_IOCTL, "LSADRV_IOC_CONTROL32\n");
-			a = karg = kmalloc(sizeof(*a), GFP_KERNEL);
-			if (!karg)
-				return -ENOMEM;
 
-			a->requesttype = ua32->requesttype;
-			a->request = ua32->request;
-			a->value = ua32->value;
-			a->index = ua32->index;
-			a->length = ua32->length;
-			a->timeout = ua32->timeout;
-			a->data = compat_ptr(ua32->data);
+			a.requesttype = ua32->requesttype;
+			a.request = ua32->request;
+			a.value = ua32->value;
+			a.index = ua32->index;
+			a.length = ua32->length;
+			a.timeout = ua32->timeout;
+			a.data = compat_ptr(ua32->data);
 
-			ret = lsadrv_ioctl_control(xdev, a);
+			ret = lsadrv_ioctl_control(xdev, &a);
 			break;
 		}
 
@@ -243,19 +324,16 @@ int lsadrv_usb_ioctl(struct lsadrv_device *xdev, unsigned int cmd, void *arg)
 		case LSADRV_IOC_BULK32:
 		{
 			struct compat_lsadrv_bulk_transfer_control *ua32 = arg;
-			struct lsadrv_bulk_transfer_control *a;
+			struct lsadrv_bulk_transfer_control a;
 
 			Trace(LSADRV_TRACE_IOCTL, "LSADRV_IOC_BULK32\n");
-			a = karg = kmalloc(sizeof(*a), GFP_KERNEL);
-			if (!karg)
-				return -ENOMEM;
 
-			a->ep = ua32->ep;
-			a->len = ua32->len;
-			a->timeout = ua32->timeout;
-			a->data = compat_ptr(ua32->data);
+			a.ep = ua32->ep;
+			a.len = ua32->len;
+			a.timeout = ua32->timeout;
+			a.data = compat_ptr(ua32->data);
 
-			ret = lsadrv_ioctl_bulk(xdev, a);
+			ret = lsadrv_ioctl_bulk(xdev, &a);
 			break;
 		}
 
@@ -263,20 +341,52 @@ int lsadrv_usb_ioctl(struct lsadrv_device *xdev, unsigned int cmd, void *arg)
 		case LSADRV_IOC_READ_ISO_BUFFER32:
 		{
 			struct compat_lsadrv_iso_read_control *ua32 = arg;
-			struct lsadrv_iso_read_control *a;
+			struct lsadrv_iso_read_control a;
 
 			Trace(LSADRV_TRACE_IOCTL, "LSADRV_IOC_READ_ISO_BUFFER32\n");
-			a = karg = kmalloc(sizeof(*a), GFP_KERNEL);
-			if (!karg)
-				return -ENOMEM;
 
-			a->PacketSize = ua32->PacketSize;
-			a->PacketCount = ua32->PacketCount;
-			a->Timeout = ua32->Timeout;
-			a->buffer = compat_ptr(ua32->buffer);
-			a->bufferSize = ua32->bufferSize;
+			a.PacketSize = ua32->PacketSize;
+			a.PacketCount = ua32->PacketCount;
+			a.Timeout = ua32->Timeout;
+			a.buffer = compat_ptr(ua32->buffer);
+			a.bufferSize = ua32->bufferSize;
+
+			ret = lsadrv_ioctl_read_iso_buffer(xdev, &a);
+			break;
+		}
+
+		/* read a batch of records from isochronous stream data buffer */
+		case LSADRV_IOC_READ_ISO_BATCH32:
+		{
+			struct compat_lsadrv_iso_batch_read_control *ua32 = arg;
+			struct lsadrv_iso_batch_read_control a;
+
+			Trace(LSADRV_TRACE_IOCTL, "LSADRV_IOC_READ_ISO_BATCH32\n");
 
-			ret = lsadrv_ioctl_read_iso_buffer(xdev, a);
+			a.PacketSize = ua32->PacketSize;
+			a.PacketCount = ua32->PacketCount;
+			a.Timeout = ua32->Timeout;
+			a.MinRecords = ua32->MinRecords;
+			a.MaxLatency = ua32->MaxLatency;
+			a.buffer = compat_ptr(ua32->buffer);
+			a.bufferSize = ua32->bufferSize;
+
+			ret = lsadrv_ioctl_read_iso_batch(xdev, &a);
+			break;
+		}
+
+		/* send a batch of mouse/keyboard input events */
+		case LSADRV_IOC_INPUTEVENTS32:
+		{
+			struct compat_lsadrv_input_events *ua32 = arg;
+			struct lsadrv_input_events a;
+
+			Trace(LSADRV_TRACE_IOCTL, "LSADRV_IOC_INPUTEVENTS32\n");
+
+			a.Count = ua32->Count;
+			a.Records = compat_ptr(ua32->Records);
+
+			ret = lsadrv_ioctl_inputevents(xdev, &a);
 			break;
 		}
 
@@ -293,8 +403,6 @@ int lsadrv_usb_ioctl(struct lsadrv_device *xdev, unsigned int cmd, void *arg)
 			break;
 	} /* ..switch (cmd) */
 
-	kfree(karg);
-
 l_ret:
 	return ret;
 }
@@ -314,27 +422,44 @@ static int lsadrv_ioctl_get_driver_version(struct lsadrv_device *xdev, void *arg
 #define BTN_LEFT	BTN_TOOL_PEN
 #endif //PREVENT_MOUSE_DRIVER_MATCH
 /* send mouse input event */
-int lsadrv_ioctl_mouseevent_dispatch(void *arg);
+int lsadrv_ioctl_mouseevent_dispatch(struct lsadrv_input_dev *xidev, void *arg);
 
 static int lsadrv_ioctl_mouseevent(struct lsadrv_device *xdev, void *arg)
 {
-  return lsadrv_ioctl_mouseevent_dispatch(arg);
+  return lsadrv_ioctl_mouseevent_dispatch(xdev->xidev, arg);
 }
 
-int lsadrv_ioctl_mouseevent_dispatch(void *arg)
+static void lsadrv_report_mouse_input(struct lsadrv_input_dev *xidev, struct input_dev *idev, const struct lsadrv_mouse_input *inp);
+
+int lsadrv_ioctl_mouseevent_dispatch(struct lsadrv_input_dev *xidev, void *arg)
 {
 	struct lsadrv_mouse_input *inp = (struct lsadrv_mouse_input*)arg;
-	struct lsadrv_input_dev *xidev = lsadrv_idev;
-	struct input_dev *idev = xidev->idev;
-	int dx = 0, dy = 0;
+	struct input_dev *idev;
+	unsigned long flags;
 
 	Trace(LSADRV_TRACE_MOUSE, "LSADRV_IOC_MOUSEEVENT: (%d,%d,0x%x)\n", inp->dx, inp->dy, inp->flags);
 
-	if (idev == NULL) {
+	if (xidev == NULL || (idev = xidev->idev) == NULL) {
 		Err("idev is NULL\n");
 		return -EFAULT;
 	}
 
+	/* a decoder may report on the same device from urb completion */
+	spin_lock_irqsave(&xidev->report_lock, flags);
+	lsadrv_report_mouse_input(xidev, idev, inp);
+    	//lsadrv_input_event(idev, EV_MSC, MSC_SERIAL, 0);
+    	lsadrv_input_sync(idev);
+	spin_unlock_irqrestore(&xidev->report_lock, flags);
+	return 0;
+}
+
+/* report a mouse input event, without input_sync */
+static void lsadrv_report_mouse_input(struct lsadrv_input_dev *xidev, struct input_dev *idev, const struct lsadrv_mouse_input *inp)
+{
+	int dx = 0, dy = 0;
+
+	trace_lsadrv_mouse_event(inp->dx, inp->dy, inp->flags);
+
 #ifndef PREVENT_MOUSE_DRIVER_MATCH
 	lsadrv_input_report_key(idev, BTN_TOUCH, 1);
 #endif //PREVENT_MOUSE_DRIVER_MATCH
@@ -391,17 +516,13 @@ int lsadrv_ioctl_mouseevent_dispatch(void *arg)
 		xidev->mouse_data[0] &= ~4;
 		lsadrv_input_report_key(idev, BTN_MIDDLE, 0);
 	}
-
-    	//lsadrv_input_event(idev, EV_MSC, MSC_SERIAL, 0);
-    	lsadrv_input_sync(idev);
-	return 0;
 }
 #else /*0*/
 /* send mouse input event */
 static int lsadrv_ioctl_mouseevent(struct lsadrv_device *xdev, void *arg)
 {
 	struct lsadrv_mouse_input *inp = (struct lsadrv_mouse_input*)arg;
-	struct lsadrv_input_dev *xidev = lsadrv_idev;
+	struct lsadrv_input_dev *xidev = xdev->xidev;
 	struct input_dev *idev = xidev->idev;
 	int dx = 0, dy = 0;
 
@@ -482,29 +603,18 @@ static int lsadrv_ioctl_mouseevent(struct lsadrv_device *xdev, void *arg)
 }
 #endif /*0*/
 
-/* send keyboard input event */
-static int lsadrv_ioctl_keybdevent(struct lsadrv_device *xdev, void *arg)
+/* report a keyboard input event, without input_sync */
+static void lsadrv_report_keybd_input(struct input_dev *idev, const struct lsadrv_keybd_input *inp)
 {
-	struct lsadrv_keybd_input *inp = (struct lsadrv_keybd_input*)arg;
-	struct lsadrv_input_dev *xidev = lsadrv_idev;
-	struct input_dev *idev = xidev->idev;
 	int key = KEY_ESC;	//dummy
 
-	Trace(LSADRV_TRACE_MOUSE, "LSADRV_IOC_KEYBDEVENT: (vk=0x%x,ext=%d,%s)\n",
-		inp->vkey, (inp->flags & KEYEVENTF_EXTENDEDKEY),
-		(inp->flags & KEYEVENTF_KEYUP) ? "off" : "on");
-
-	if (idev == NULL) {
-		Err("idev is NULL\n");
-		return -EFAULT;
-	}
-
 	if (inp->flags & KEYEVENTF_INPUT_KEY) {
 		key = inp->vkey;
 	}
 	else {
 		key = lsadrv_vkeytokey(inp->vkey, (inp->flags & KEYEVENTF_EXTENDEDKEY));
 	}
+	trace_lsadrv_key_event(inp->vkey, key, inp->flags);
 
 	if (inp->flags & KEYEVENTF_KEYUP) {
 		lsadrv_input_report_key(idev, key, 0);
@@ -512,11 +622,118 @@ static int lsadrv_ioctl_keybdevent(struct lsadrv_device *xdev, void *arg)
 	else {
 		lsadrv_input_report_key(idev, key, 1);
 	}
+}
+
+/* send keyboard input event */
+static int lsadrv_ioctl_keybdevent(struct lsadrv_device *xdev, void *arg)
+{
+	struct lsadrv_keybd_input *inp = (struct lsadrv_keybd_input*)arg;
+	struct lsadrv_input_dev *xidev = xdev->xidev;
+	struct input_dev *idev;
+	unsigned long flags;
+
+	Trace(LSADRV_TRACE_MOUSE, "LSADRV_IOC_KEYBDEVENT: (vk=0x%x,ext=%d,%s)\n",
+		inp->vkey, (inp->flags & KEYEVENTF_EXTENDEDKEY),
+		(inp->flags & KEYEVENTF_KEYUP) ? "off" : "on");
+
+	if (xidev == NULL || (idev = xidev->idev) == NULL) {
+		Err("idev is NULL\n");
+		return -EFAULT;
+	}
+
+	spin_lock_irqsave(&xidev->report_lock, flags);
+	lsadrv_report_keybd_input(idev, inp);
     	//lsadrv_input_event(idev, EV_MSC, MSC_SERIAL, 0);
     	lsadrv_input_sync(idev);
+	spin_unlock_irqrestore(&xidev->report_lock, flags);
 	return 0;
 }
 
+/* send a batch of mouse/keyboard input events */
+int lsadrv_ioctl_inputevents_dispatch(struct lsadrv_input_dev *xidev, const struct lsadrv_input_events *events);
+
+static int lsadrv_ioctl_inputevents(struct lsadrv_device *xdev, void *arg)
+{
+	return lsadrv_ioctl_inputevents_dispatch(xdev->xidev, (struct lsadrv_input_events*)arg);
+}
+
+/*
+ * the records are copied in chunks and reported with one input_sync per
+ * LSADRV_INPUT_SYNC record, instead of one ioctl and input_sync per event.
+ * Each chunk is reported under report_lock, against the decoders, so a
+ * report still open at the end of a chunk is synced there.
+ * 	return value: 0: all records reported; <0:error (the records before the
+ * 	              bad one are reported and synced)
+ */
+int lsadrv_ioctl_inputevents_dispatch(struct lsadrv_input_dev *xidev, const struct lsadrv_input_events *events)
+{
+	struct lsadrv_input_record recs[16];
+	struct input_dev *idev;
+	unsigned int done, n, i;
+	unsigned long flags;
+	int pending = 0;
+	int ret = 0;
+
+	Trace(LSADRV_TRACE_MOUSE, "LSADRV_IOC_INPUTEVENTS: %u records\n", events->Count);
+
+	if (xidev == NULL || (idev = xidev->idev) == NULL) {
+		Err("idev is NULL\n");
+		return -EFAULT;
+	}
+	if (events->Count > LSADRV_INPUT_MAX_RECORDS) {
+		return -EINVAL;
+	}
+
+	for (done = 0; done < events->Count && ret == 0; done += n) {
+		n = min_t(unsigned int, events->Count - done, ARRAY_SIZE(recs));
+		if (lsadrv_copy_from_user(recs, events->Records + done, n * sizeof(recs[0]))) {
+			ret = -EFAULT;
+			break;
+		}
+		spin_lock_irqsave(&xidev->report_lock, flags);
+		for (i = 0; i < n; i++) {
+			switch (recs[i].type) {
+				case LSADRV_INPUT_MOUSE:
+					lsadrv_report_mouse_input(xidev, idev, &recs[i].u.mouse);
+					pending = 1;
+					break;
+				case LSADRV_INPUT_KEYBD:
+					lsadrv_report_keybd_input(idev, &recs[i].u.keybd);
+					pending = 1;
+					break;
+				case LSADRV_INPUT_SYNC:
+					if (pending) {
+						lsadrv_input_sync(idev);
+						pending = 0;
+					}
+					break;
+				default:
+					Err("inputevents: invalid record type %d\n", recs[i].type);
+					ret = -EINVAL;
+					break;
+			}
+			if (ret) {
+				break;
+			}
+		}
+		if (pending) {
+			lsadrv_input_sync(idev);
+			pending = 0;
+		}
+		spin_unlock_irqrestore(&xidev->report_lock, flags);
+	}
+	return ret;
+}
+
+/* report a multi-touch frame */
+static int lsadrv_ioctl_mt_frame(struct lsadrv_device *xdev, void *arg)
+{
+	struct lsadrv_mt_frame *frame = (struct lsadrv_mt_frame*)arg;
+
+	Trace(LSADRV_TRACE_MOUSE, "LSADRV_IOC_MT_FRAME: %u contacts\n", frame->Count);
+	return lsadrv_report_mt_frame(xdev, frame);
+}
+
 /* get device descriptor */
 static int lsadrv_ioctl_get_device_descriptor(struct lsadrv_device *xdev, void *arg)
 {
@@ -565,7 +782,7 @@ static int lsadrv_ioctl_control(struct lsadrv_device *xdev, void *arg)
 	}
 
 	if (ctrl->length) {
-		if (!(tbuf = (unsigned char *)lsadrv_malloc(ctrl->length))) {
+		if (!(tbuf = lsadrv_get_io_buffer(xdev, ctrl->length))) {
 			return -ENOMEM;
 		}
 	}
@@ -575,7 +792,7 @@ static int lsadrv_ioctl_control(struct lsadrv_device *xdev, void *arg)
 	if (ctrl->requesttype & 0x80) {
 		/* IN transfer */
 		if (ctrl->length && !lsadrv_write_ok(ctrl->data, ctrl->length)) {
-			lsadrv_free(tbuf);
+			lsadrv_put_io_buffer(xdev, tbuf);
 			return -EINVAL;
 		}
 		i = lsadrv_usb_control_msg(udev, lsadrv_usb_rcvctrlpipe(udev, 0), ctrl->request, ctrl->requesttype,
@@ -583,7 +800,7 @@ static int lsadrv_ioctl_control(struct lsadrv_device *xdev, void *arg)
 		if (i > 0) {
 			if ((ret=lsadrv_copy_to_user(ctrl->data, tbuf, i))) {
 				Err("%s: copy_to_user error(%d)", __func__, ret);
-				lsadrv_free(tbuf);
+				lsadrv_put_io_buffer(xdev, tbuf);
 				return -EFAULT;
 			}
 		}
@@ -591,7 +808,7 @@ static int lsadrv_ioctl_control(struct lsadrv_device *xdev, void *arg)
 		/* OUT transfer */
 		if (ctrl->length) {
 			if (lsadrv_copy_from_user(tbuf, ctrl->data, ctrl->length)) {
-				lsadrv_free(tbuf);
+				lsadrv_put_io_buffer(xdev, tbuf);
 				return -EFAULT;
 			}
 		}
@@ -601,7 +818,7 @@ static int lsadrv_ioctl_control(struct lsadrv_device *xdev, void *arg)
 	if (i < 0) {
 		xdev->LastFailedUrbStatus = i;
 	}
-	lsadrv_free(tbuf);
+	lsadrv_put_io_buffer(xdev, tbuf);
 	return i;
 }
 
@@ -640,7 +857,7 @@ static int lsadrv_ioctl_bulk(struct lsadrv_device *xdev, void *arg)
 	}
 
 	if (bulk->len) {
-		if (!(tbuf = (unsigned char *)lsadrv_malloc(bulk->len))) {
+		if (!(tbuf = lsadrv_get_io_buffer(xdev, bulk->len))) {
 			return -ENOMEM;
 		}
 	}
@@ -650,14 +867,14 @@ static int lsadrv_ioctl_bulk(struct lsadrv_device *xdev, void *arg)
 	if (bulk->ep & USB_DIR_IN) {
 		/* IN transfer */
 		if (bulk->len && !lsadrv_write_ok(bulk->data, bulk->len)) {
-			lsadrv_free(tbuf);
+			lsadrv_put_io_buffer(xdev, tbuf);
 			return -EINVAL;
 		}
 		i = lsadrv_usb_bulk_msg(udev, pipe, tbuf, bulk->len, &actlen, timeout);
 		if (i == 0 && actlen) {
 			if ((ret=lsadrv_copy_to_user(bulk->data, tbuf, actlen))) {
 				Err("%s: copy_to_user error(%d)", __func__, ret);
-				lsadrv_free(tbuf);
+				lsadrv_put_io_buffer(xdev, tbuf);
 				return -EFAULT;
 			}
 		}
@@ -665,13 +882,13 @@ static int lsadrv_ioctl_bulk(struct lsadrv_device *xdev, void *arg)
 		/* OUT transfer */
 		if (bulk->len) {
 			if (lsadrv_copy_from_user(tbuf, bulk->data, bulk->len)) {
-				lsadrv_free(tbuf);
+				lsadrv_put_io_buffer(xdev, tbuf);
 				return -EFAULT;
 			}
 		}
 		i = lsadrv_usb_bulk_msg(udev, pipe, tbuf, bulk->len, &actlen, timeout);
 	}
-	lsadrv_free(tbuf);
+	lsadrv_put_io_buffer(xdev, tbuf);
 
 	if (i < 0) {	/* error */
 		xdev->LastFailedUrbStatus = i;
@@ -791,7 +1008,8 @@ static int lsadrv_ioctl_start_iso_stream(struct lsadrv_device *xdev, void *arg)
 				iso->PacketSize,
 				iso->PacketCount,
 				iso->FramesPerBuffer,
-				iso->BufferCount);
+				iso->BufferCount,
+				iso->Flags);
 	}
 	return ret;
 }
@@ -809,14 +1027,36 @@ static int lsadrv_ioctl_stop_iso_stream(struct lsadrv_device *xdev)
 static int lsadrv_ioctl_read_iso_buffer(struct lsadrv_device *xdev, void *arg)
 {
 	struct lsadrv_iso_read_control* isor = (struct lsadrv_iso_read_control*) arg;
+	struct lsadrv_iso_batch_read_control batch;
+
+	/* return on the first record */
+	batch.PacketSize = isor->PacketSize;
+	batch.PacketCount = isor->PacketCount;
+	batch.Timeout = isor->Timeout;
+	batch.MinRecords = 1;
+	batch.MaxLatency = 0;
+	batch.buffer = isor->buffer;
+	batch.bufferSize = isor->bufferSize;
+	return lsadrv_ioctl_read_iso_batch(xdev, &batch);
+}
+
+/* read a batch of records from isochronous stream data buffer */
+/* 	return value: >=0: length of data transfered; <0:error */
+static int lsadrv_ioctl_read_iso_batch(struct lsadrv_device *xdev, void *arg)
+{
+	struct lsadrv_iso_batch_read_control* isor = (struct lsadrv_iso_batch_read_control*) arg;
 	int ret;
 	unsigned int recSize;
 	unsigned int bufsize;
 	unsigned int bytesRead = 0;
-	unsigned char* kbuf;
 	long timeout;	/* jiffies */
 
-	recSize = isor->PacketSize + sizeof(struct lsadrv_iso_packet_desc);
+	ret = lsadrv_get_iso_record_size(xdev);
+	if (ret < 0) {
+		Err("read_iso_buffer: buffer is absent\n");
+		return ret;
+	}
+	recSize = ret;
 	bufsize = recSize * isor->PacketCount;
 	if (isor->bufferSize < bufsize) {
 		Err("read_iso_buffer: too short buffer: buffer size %u must be >= %u\n", isor->bufferSize, bufsize);
@@ -828,31 +1068,45 @@ static int lsadrv_ioctl_read_iso_buffer(struct lsadrv_device *xdev, void *arg)
 		return -EINVAL;
 	}
 
-	kbuf = lsadrv_malloc(bufsize);
-	if (kbuf == NULL) {
-		return -ENOMEM;
-	}
-
 	timeout = lsadrv_msec_to_jiffies(isor->Timeout);
 
+	/* records are copied from the ring to isor->buffer directly */
 	ret = lsadrv_read_iso_buffer(xdev,
 			isor->PacketCount, 
 			isor->PacketSize, 
-			kbuf, 
+			isor->buffer, 
 			&bytesRead, 
-			timeout);
+			timeout,
+			isor->MinRecords,
+			isor->MaxLatency);
 	if (ret == 0 && bytesRead) {
-		if ((ret=lsadrv_copy_to_user(isor->buffer, kbuf, bytesRead))) {
-			Err("%s: copy_to_user error(%d)", __func__, ret);
-			lsadrv_free(kbuf);
-			return -EFAULT;
-		}
 		ret = bytesRead;
 	}
-	lsadrv_free(kbuf);
 	return ret;
 }
 
+/* wait until the isochronous stream ring has data */
+/* 	return value: >0: bytes available; 0: timed out; <0:error */
+static int lsadrv_ioctl_wait_iso_buffer(struct lsadrv_device *xdev, void *arg)
+{
+	unsigned int msec = *(unsigned int*)arg;
+
+	Trace(LSADRV_TRACE_IOCTL, "ioctl_wait_iso_buffer: timeout=%u\n", msec);
+	return lsadrv_wait_iso_buffer(xdev, lsadrv_msec_to_jiffies(msec));
+}
+
+/* get the number of stream records dropped because the ring was full */
+static int lsadrv_ioctl_get_iso_dropped(struct lsadrv_device *xdev, void *arg)
+{
+	int ret;
+
+	ret = lsadrv_get_iso_dropped(xdev, (unsigned int*)arg);
+	if (ret < 0) {
+		return ret;
+	}
+	return sizeof(unsigned int);
+}
+
 static int lsadrv_ioctl_claim_stream(struct lsadrv_device *xdev, void *arg)
 {
 	int flg = *(int*)arg;
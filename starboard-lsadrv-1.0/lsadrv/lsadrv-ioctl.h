@@ -61,6 +61,56 @@ struct lsadrv_keybd_input {
 #define KEYEVENTF_SCANCODE      0x0008
 #define KEYEVENTF_INPUT_KEY     0x8000 /* key code defined in input.h */
 
+/*--------------------------------------------------------------------------
+ * batch of mouse/keyboard input events (LSADRV_IOC_INPUTEVENTS)
+ *--------------------------------------------------------------------------*/
+struct lsadrv_input_record {
+    int type;	/* LSADRV_INPUT_* */
+    union {
+	struct lsadrv_mouse_input mouse;
+	struct lsadrv_keybd_input keybd;
+    } u;
+};
+/* type */
+#define LSADRV_INPUT_MOUSE      1 /* u.mouse, as LSADRV_IOC_MOUSEEVENT */
+#define LSADRV_INPUT_KEYBD      2 /* u.keybd, as LSADRV_IOC_KEYBDEVENT */
+#define LSADRV_INPUT_SYNC       3 /* the events so far form one report */
+
+/*
+ * the events are reported in order, with an input_sync at each
+ * LSADRV_INPUT_SYNC record and after the last record if it is not one.
+ * The driver also syncs every 16 records, so keep a report shorter.
+ */
+struct lsadrv_input_events {
+    unsigned int Count;	/* number of records */
+    struct lsadrv_input_record *Records;
+};
+#define LSADRV_INPUT_MAX_RECORDS 4096	/* per ioctl */
+
+/*--------------------------------------------------------------------------
+ * multi-touch frame (LSADRV_IOC_MT_FRAME)
+ *--------------------------------------------------------------------------*/
+#define LSADRV_MT_MAX_CONTACTS	10
+
+struct lsadrv_mt_contact {
+	int32_t  x;		/* 0..65535, as MOUSEEVENTF_ABSOLUTE */
+	int32_t  y;
+	int32_t  pressure;	/* 0..1023 */
+	u_int32_t tool;		/* LSADRV_MT_TOOL_* */
+};
+#define LSADRV_MT_TOOL_FINGER	0
+#define LSADRV_MT_TOOL_PEN	1
+
+/*
+ * all contacts touching the board at one time; contacts not in the frame
+ * are lifted.  The driver keeps the slots (tracking ids) by matching
+ * positions with the previous frame.
+ */
+struct lsadrv_mt_frame {
+	u_int32_t Count;
+	struct lsadrv_mt_contact Contacts[LSADRV_MT_MAX_CONTACTS];
+};
+
 #ifndef __KERNEL__
 #ifndef __LINUX_USB_CH9_H
 /*--------------------------------------------------------------------------
@@ -158,7 +208,30 @@ struct lsadrv_iso_transfer_control
 	 */
 	unsigned int FramesPerBuffer;     // 10 is a good value
 	unsigned int BufferCount;         // 2 is a good value
+	/*
+	 * LSADRV_ISO_FLAG_*.  Drivers before 1.3 don't know this field;
+	 * the ioctl of the old structure size is still accepted (Flags = 0).
+	 */
+	unsigned int Flags;
 };
+/*
+ * OR into BufferCount to let the driver adjust the number of transfer
+ * buffers in flight: it starts with BufferCount and grows when USB frames
+ * are skipped or completions come late, and shrinks back (not below 2)
+ * while the stream runs smoothly.
+ */
+#define LSADRV_ISO_ADAPTIVE_BUFFERS	0x80000000
+
+/* Flags */
+/* records end with struct lsadrv_iso_packet_desc_v2 instead of lsadrv_iso_packet_desc */
+#define LSADRV_ISO_FLAG_RECORD_V2	0x0001
+/*
+ * compact records: the packet descriptor comes first and is followed by
+ * only Length data bytes, padded to LSADRV_ISO_COMPACT_ALIGN
+ */
+#define LSADRV_ISO_FLAG_COMPACT		0x0002
+
+#define LSADRV_ISO_COMPACT_ALIGN	8
 
 /*--------------------------------------------------------------------------
  * control structure for reading isochronous stream data
@@ -169,6 +242,15 @@ struct lsadrv_iso_packet_desc {
 	unsigned int Status;
 };
 
+/* isochronous transfer packet descriptor, LSADRV_ISO_FLAG_RECORD_V2 */
+struct lsadrv_iso_packet_desc_v2 {
+	u_int32_t Length;	/* actual length of data received */
+	u_int32_t Status;
+	u_int32_t FrameNumber;	/* USB frame number the packet was received in */
+	u_int32_t Reserved;
+	u_int64_t Timestamp;	/* CLOCK_MONOTONIC (ns) of the urb completion */
+};
+
 struct lsadrv_iso_read_control
 {
 	unsigned int PacketSize;
@@ -178,6 +260,68 @@ struct lsadrv_iso_read_control
 	unsigned char *buffer;
 	unsigned int  bufferSize;	/* IN: buffer sizer */
 		/* buffer size = (PacketSize + sizeof(struct lsadrv_iso_packet_desc)) * PacketCount */
+		/*   (sizeof(struct lsadrv_iso_packet_desc_v2) with LSADRV_ISO_FLAG_RECORD_V2) */
+		/*   (the same size rounded up to LSADRV_ISO_COMPACT_ALIGN with LSADRV_ISO_FLAG_COMPACT) */
+		/* only whole records are returned */
+};
+
+/* LSADRV_IOC_READ_ISO_BATCH */
+struct lsadrv_iso_batch_read_control
+{
+	unsigned int PacketSize;
+	unsigned int PacketCount;	/* at most this many records are returned */
+	/* Timeout for reading ISO buffer (msec) */
+	unsigned int Timeout;
+	/*
+	 * Return as soon as MinRecords records are available, or when the
+	 * oldest unread record is MaxLatency usec old (0: wait for MinRecords
+	 * or Timeout).  On timeout whatever is there is returned.
+	 */
+	unsigned int MinRecords;
+	unsigned int MaxLatency;
+	unsigned char *buffer;
+	unsigned int  bufferSize;	/* IN: buffer size, as for lsadrv_iso_read_control */
+};
+
+/*--------------------------------------------------------------------------
+ * shared control page of the mmap'ed isochronous stream ring
+ *--------------------------------------------------------------------------*/
+/*
+ * The stream ring can be mapped from the lsadrv character device
+ * (/dev/usb/lsadrvN) by the process which claimed the stream:
+ *   offset 0:          this control page (PROT_READ|PROT_WRITE)
+ *   offset DataOffset: Size bytes of ring data (PROT_READ only)
+ * Head and Tail are free-running byte counters; the data of counter c is
+ * at (c & (Size - 1)) and records may wrap at the end of the data area.
+ * Each record is PacketSize data bytes followed by lsadrv_iso_packet_desc
+ * (lsadrv_iso_packet_desc_v2 when Flags has LSADRV_ISO_FLAG_RECORD_V2).
+ * With LSADRV_ISO_FLAG_COMPACT each record is the packet descriptor
+ * followed by Length data bytes, padded to LSADRV_ISO_COMPACT_ALIGN; the
+ * next record starts right after it and RecordSize is the largest size a
+ * record can have.
+ * The ring only ever holds whole records: Head and Tail move by whole
+ * records, and when the ring is full the driver drops the oldest records
+ * and counts them in Dropped.
+ * The reader consumes whole records of [Tail, Head) in place and then
+ * releases them with a compare-and-swap of Tail.  If the swap fails the
+ * driver has dropped the oldest records meanwhile, so what was read must
+ * be discarded.
+ * Use LSADRV_IOC_WAIT_ISO_BUFFER to sleep while the ring is empty.
+ * The mapping stays valid after the stream is stopped, but a restarted
+ * stream uses a new ring which must be mapped again.
+ */
+struct lsadrv_iso_ring_control
+{
+	u_int32_t Head;		/* advanced by the driver */
+	u_int32_t Reserved1[15];
+	u_int32_t Tail;		/* advanced by the reader */
+	u_int32_t Reserved2[15];
+	u_int32_t Size;		/* size of the data area (power of 2) */
+	u_int32_t DataOffset;	/* mmap offset of the data area */
+	u_int32_t PacketSize;
+	u_int32_t RecordSize;	/* PacketSize + size of the packet descriptor (maximum with LSADRV_ISO_FLAG_COMPACT) */
+	u_int32_t Dropped;	/* records dropped because the ring was full */
+	u_int32_t Flags;	/* LSADRV_ISO_FLAG_* the stream was started with */
 };
 
 // device file in /proc file system
@@ -286,6 +430,28 @@ struct lsadrv_driver_version
 #define LSADRV_IOC_GET_CURRENT_FRAME_NUMBER	_IOR(LSADRV_IOC_MAGIC, \
 							LSADRV_IOCTL_BASE + 22, \
 							int)
+/* wait until the isochronous stream ring has data (timeout in msec) */
+/* 	return value: >0: bytes available in the ring; 0: timed out; <0:error */
+#define LSADRV_IOC_WAIT_ISO_BUFFER		_IOW(LSADRV_IOC_MAGIC, \
+							LSADRV_IOCTL_BASE + 23, \
+							unsigned int)
+/* get the number of stream records dropped because the ring was full */
+#define LSADRV_IOC_GET_ISO_DROPPED		_IOR(LSADRV_IOC_MAGIC, \
+							LSADRV_IOCTL_BASE + 24, \
+							unsigned int)
+/* read a batch of records from isochronous stream data buffer */
+/* 	return value: >=0: length of data transfered; <0:error */
+#define LSADRV_IOC_READ_ISO_BATCH		_IOW(LSADRV_IOC_MAGIC, \
+							LSADRV_IOCTL_BASE + 25, \
+							struct lsadrv_iso_batch_read_control)
+/* report a multi-touch frame, with a single input_sync */
+#define LSADRV_IOC_MT_FRAME			_IOW(LSADRV_IOC_MAGIC, \
+							LSADRV_IOCTL_BASE + 26, \
+							struct lsadrv_mt_frame)
+/* send a batch of mouse/keyboard input events */
+#define LSADRV_IOC_INPUTEVENTS			_IOW(LSADRV_IOC_MAGIC, \
+							LSADRV_IOCTL_BASE + 27, \
+							struct lsadrv_input_events)
 
 #ifdef __cplusplus
 }
@@ -18,30 +18,72 @@
  *
 ============================================================================*/
 
+#include <linux/log2.h>		/* for roundup_pow_of_two */
+#include <linux/atomic.h>	/* for cmpxchg */
+#include <linux/kref.h>
+#include <linux/mm.h>		/* for vm_area_struct */
+
 #include "lsadrv.h"
 #include "lsadrv-ioctl.h"
+#include "lsadrv-decoder.h"
+#include "lsadrv-trace.h"
+
+/* number of urbs in flight */
+#define STREAM_TRANSFER_MIN	2U
+#define STREAM_TRANSFER_MAX	16U
 
-#define STREAM_TRANSFER_COUNT	2U
+/* adaptive mode: skipped frames further than this are taken as a frame number wrap */
+#define STREAM_FRAME_GAP_WINDOW	256
+/* adaptive mode: completions without trouble before giving one urb back */
+#define STREAM_ADAPT_QUIET_PERIOD	1000U
 
-/* ring buffer for isochronous stream data */
+/* stop: longest wait for the completion handlers after the urbs are killed (msec) */
+#define STREAM_STOP_TIMEOUT	1000
+
+/*
+ * ring buffer for isochronous stream data
+ *
+ * Single producer (lsadrv_isoc_handler) / single consumer (lsadrv_read_iso_buffer
+ * or the process which mapped the ring).
+ * Head and Tail are free-running byte counters kept in the control page
+ * shared with user space (struct lsadrv_iso_ring_control); totalSize is a
+ * power of two so that (counter & mask) gives the buffer offset.  The
+ * producer publishes data with a release store of Head, the consumer frees
+ * space by advancing Tail.  In overwrite mode the producer pushes Tail
+ * forward itself by whole records, so the consumer commits its read with
+ * cmpxchg and retries if it lost the race.
+ * Compact rings (LSADRV_ISO_FLAG_COMPACT) hold records of variable size;
+ * the size of the record at a counter is read from the Length of its
+ * leading packet descriptor (RingRecordSize).
+ */
 struct lsadrv_ring_buffer
 {
-	unsigned char	*inPtr;
-	unsigned char	*outPtr;
+	struct lsadrv_iso_ring_control *ctrl;	/* first page of the mapping */
+	unsigned int	 head;			/* producer's copy of ctrl->Head */
 	unsigned int	 totalSize;
-	unsigned int	 currentSize;
-	unsigned char	*buffer;
-	spinlock_t	*spinLock;	/* for manipulating the buffer pointers */
-	wait_queue_head_t *waitq;	/* waken up when ring buffer have available data */
+	unsigned int	 mask;
+	unsigned int	 recSize;		/* Head and Tail move by whole records (largest record if compact) */
+	unsigned int	 capacity;		/* bytes in whole records */
+	int		 compact;		/* variable size records */
+	unsigned int	 descSize;		/* packet descriptor size of compact records */
+	unsigned int	 packetSize;
+	unsigned char	*buffer;		/* ctrl + PAGE_SIZE */
+	unsigned long	 mapSize;		/* control page + data pages */
+	unsigned long long firstTime;		/* ns, when the oldest unread record came (approx., 0: unknown) */
+	unsigned long	 droppedBytes;		/* producer's count of overwritten bytes */
+	struct kref	 ref;			/* stream + user mappings + readers */
+	wait_queue_head_t *waitq;	/* waken up when ring buffer have available data (xdev->stream_wait) */
 };
 
 /* isochronous transfer object per urb */
 struct lsadrv_iso_transfer_object
 {
 	unsigned int frame;
+	int active;		/* urb is submitted */
 	struct lsadrv_iso_stream_object *stream;
 	struct urb *urb;
 	unsigned char *data;
+	dma_addr_t dma;		/* of data, if the stream is Coherent */
 #if LSADRV_DEBUG
 /* for debug */
 	unsigned int trans_count;
@@ -53,13 +95,30 @@ struct lsadrv_iso_stream_object
 {
 	struct lsadrv_device *xdev;
 	unsigned int PacketSize;
+	unsigned int RecordSize;	/* PacketSize + packet descriptor (largest record if compact) */
+	unsigned int DescSize;		/* packet descriptor size */
+	unsigned int Flags;		/* LSADRV_ISO_FLAG_* */
 	unsigned int TransferBufferLength;
+	int Coherent;			/* transfer buffers from lsadrv_usb_alloc_coherent */
+	unsigned int Pipe;
+	unsigned int PacketCount;	/* ring size in records */
 	unsigned int FramesPerBuffer;
 	unsigned int BufferCount;
-	unsigned int TransferCount;
+	unsigned int TransferCount;	/* number of allocated transfer objects */
 	unsigned int PendingTransfers;
+	struct usb_anchor *Anchor;	/* urbs in flight */
+	struct completion *Idle;	/* PendingTransfers dropped to 0 */
+	/* adaptive number of urbs in flight (LSADRV_ISO_ADAPTIVE_BUFFERS) */
+	int Adaptive;
+	unsigned int ActiveTransfers;	/* urbs kept in flight */
+	int NextStartFrame;		/* expected start frame of the next completed urb */
+	unsigned long long LastCompletion;	/* ns */
+	unsigned int QuietCompletions;
 	struct lsadrv_ring_buffer *RingBuffer;
 	struct lsadrv_iso_transfer_object *transferObjects;
+	/* in-kernel decoder (lsadrv_decoder_name), NULL if user space decodes */
+	struct lsadrv_decoder *Decoder;
+	void *DecoderState;
 	// data error count
 	unsigned int TotalDataErrorCount;
 };
@@ -67,195 +126,385 @@ struct lsadrv_iso_stream_object
 /***************************************************************************/
 /* Private functions */
 
+static void
+ReleaseRingBuffer(struct kref *ref)
+{
+	struct lsadrv_ring_buffer *ringBuffer = container_of(ref, struct lsadrv_ring_buffer, ref);
+
+	Trace(LSADRV_TRACE_MEMORY, "ReleaseRingBuffer:0x%p\n", ringBuffer);
+	lsadrv_vfree(ringBuffer->ctrl);
+	lsadrv_free(ringBuffer);
+}
+
+/* drop the stream's reference; the memory goes when the last mapping does */
 static void
 FreeRingBuffer(struct lsadrv_ring_buffer *ringBuffer)
 {
 	Trace(LSADRV_TRACE_MEMORY, "FreeRingBuffer:0x%p\n", ringBuffer);
 	if (ringBuffer) {
-		lsadrv_free_waitqueue_head(ringBuffer->waitq);
-		lsadrv_spin_lock_term(ringBuffer->spinLock);
-		lsadrv_free(ringBuffer->buffer);
-		lsadrv_free(ringBuffer);
+		kref_put(&ringBuffer->ref, ReleaseRingBuffer);
+	}
+}
+
+/* user space still maps or reads the ring (the stream holds one reference) */
+static int
+RingBufferMapped(struct lsadrv_ring_buffer *ringBuffer)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	return kref_read(&ringBuffer->ref) > 1;
+#else
+	return atomic_read(&ringBuffer->ref.refcount) > 1;
+#endif
+}
+
+/*
+ * the ring of the running stream with a reference, or NULL.  A stop may
+ * park or free the stream as soon as the lock is dropped, so the callers
+ * only use the ring and drop it with PutRingBuffer().
+ */
+static struct lsadrv_ring_buffer *
+GetStreamRingBuffer(struct lsadrv_device *xdev)
+{
+	struct lsadrv_ring_buffer *ringBuffer = NULL;
+	unsigned long flags;
+
+	lsadrv_spin_lock(xdev->streamLock, &flags);
+	if (xdev->stream && xdev->stream->RingBuffer) {
+		ringBuffer = xdev->stream->RingBuffer;
+		kref_get(&ringBuffer->ref);
 	}
+	lsadrv_spin_unlock(xdev->streamLock, &flags);
+	return ringBuffer;
+}
+
+static inline void
+PutRingBuffer(struct lsadrv_ring_buffer *ringBuffer)
+{
+	kref_put(&ringBuffer->ref, ReleaseRingBuffer);
+}
+
+/* empty the ring of a reused stream */
+static void
+ResetRingBuffer(struct lsadrv_ring_buffer *ringBuffer)
+{
+	ringBuffer->ctrl->Head = 0;
+	ringBuffer->ctrl->Tail = 0;
+	ringBuffer->ctrl->Dropped = 0;
+	ringBuffer->head = 0;
+	ringBuffer->firstTime = 0;
 }
 
 static struct lsadrv_ring_buffer*
-AllocRingBuffer(size_t size)
+AllocRingBuffer(size_t size, unsigned int packetSize, unsigned int descSize,
+		unsigned int recSize, unsigned int flags, wait_queue_head_t *waitq)
 {
 	struct lsadrv_ring_buffer *ringBuffer = NULL;
+	struct lsadrv_iso_ring_control *ctrl;
+
+	if (size == 0) {
+		return NULL;
+	}
+	/* index arithmetic needs a power of two */
+	size = roundup_pow_of_two(size);
 
 	ringBuffer = lsadrv_malloc(sizeof(struct lsadrv_ring_buffer));
 	if (!ringBuffer) {
 		return NULL;
 	}
 
-	ringBuffer->buffer = lsadrv_malloc(size);
-	if (!ringBuffer->buffer) {
+	/* control page followed by the data, page aligned for mmap */
+	ringBuffer->mapSize = PAGE_SIZE + PAGE_ALIGN(size);
+	ctrl = lsadrv_vmalloc_user(ringBuffer->mapSize);
+	if (!ctrl) {
 		lsadrv_free(ringBuffer);
 		return NULL;
 	}
 
-	ringBuffer->inPtr = ringBuffer->buffer;
-	ringBuffer->outPtr = ringBuffer->buffer;
+	ctrl->Head = 0;
+	ctrl->Tail = 0;
+	ctrl->Size = size;
+	ctrl->DataOffset = PAGE_SIZE;
+	ctrl->PacketSize = packetSize;
+	ctrl->RecordSize = recSize;
+	ctrl->Dropped = 0;
+	ctrl->Flags = flags;
+
+	ringBuffer->ctrl = ctrl;
+	ringBuffer->head = 0;
+	ringBuffer->buffer = (unsigned char *)ctrl + PAGE_SIZE;
 	ringBuffer->totalSize = size;
-	ringBuffer->currentSize = 0;
-
-	lsadrv_spin_lock_init(&ringBuffer->spinLock);
-	if (ringBuffer->spinLock == NULL) {
-		lsadrv_free(ringBuffer->buffer);
-		lsadrv_free(ringBuffer);
-		return NULL;
+	ringBuffer->mask = size - 1;
+	ringBuffer->recSize = ctrl->RecordSize;
+	ringBuffer->compact = (flags & LSADRV_ISO_FLAG_COMPACT) != 0;
+	ringBuffer->descSize = descSize;
+	ringBuffer->packetSize = packetSize;
+	if (ringBuffer->compact) {
+		/* records are aligned and so is size */
+		ringBuffer->capacity = size;
 	}
-	lsadrv_init_waitqueue_head(&ringBuffer->waitq);	/* waken up when ring buffer have available data */
-	if (ringBuffer->waitq == NULL) {
-		lsadrv_spin_lock_term(ringBuffer->spinLock);
-		lsadrv_free(ringBuffer->buffer);
-		lsadrv_free(ringBuffer);
-		return NULL;
+	else {
+		ringBuffer->capacity = rounddown(size, ringBuffer->recSize);
 	}
+	kref_init(&ringBuffer->ref);
+	ringBuffer->waitq = waitq;	/* waken up when ring buffer have available data */
 	return ringBuffer;
 }
 
+/* copy out of the ring starting at counter 'pos', handling the wrap */
+static void
+CopyFromRingBuffer(
+	struct lsadrv_ring_buffer *ringBuffer,
+	unsigned char *dst,
+	unsigned int   pos,
+	unsigned int   count)
+{
+	unsigned int offset = pos & ringBuffer->mask;
+	unsigned int fragSize = min(count, ringBuffer->totalSize - offset);
+
+	memcpy(dst, ringBuffer->buffer + offset, fragSize);
+	memcpy(dst + fragSize, ringBuffer->buffer, count - fragSize);
+}
+
+/* copy out of the ring to user space; returns non-zero on a fault */
+static unsigned long
+CopyFromRingBufferToUser(
+	struct lsadrv_ring_buffer *ringBuffer,
+	void          *dst,
+	unsigned int   pos,
+	unsigned int   count)
+{
+	unsigned int offset = pos & ringBuffer->mask;
+	unsigned int fragSize = min(count, ringBuffer->totalSize - offset);
+
+	return lsadrv_copy_to_user(dst, ringBuffer->buffer + offset, fragSize) |
+	       lsadrv_copy_to_user((unsigned char *)dst + fragSize, ringBuffer->buffer, count - fragSize);
+}
+
+/* copy into the ring starting at counter 'pos', handling the wrap */
+static void
+CopyToRingBuffer(
+	struct lsadrv_ring_buffer *ringBuffer,
+	const unsigned char *src,
+	unsigned int   pos,
+	unsigned int   count)
+{
+	unsigned int offset = pos & ringBuffer->mask;
+	unsigned int fragSize = min(count, ringBuffer->totalSize - offset);
+
+	memcpy(ringBuffer->buffer + offset, src, fragSize);
+	memcpy(ringBuffer->buffer, src + fragSize, count - fragSize);
+}
+
+/*
+ * size of the record at counter 'pos', 0 if the data there doesn't look
+ * like a record (user space moved Tail off a record boundary)
+ */
+static unsigned int
+RingRecordSize(struct lsadrv_ring_buffer *ringBuffer, unsigned int pos)
+{
+	unsigned int length;
+
+	if (!ringBuffer->compact) {
+		return ringBuffer->recSize;
+	}
+	if (pos & (LSADRV_ISO_COMPACT_ALIGN - 1)) {
+		return 0;
+	}
+	/* Length leads the descriptor and never wraps: pos and Size are aligned */
+	length = READ_ONCE(*(u_int32_t *)(ringBuffer->buffer + (pos & ringBuffer->mask)));
+	if (length > ringBuffer->packetSize) {
+		return 0;
+	}
+	return ALIGN(ringBuffer->descSize + length, LSADRV_ISO_COMPACT_ALIGN);
+}
+
+/* bytes of the whole records in [tail, tail + avail) that fit in limit */
+static unsigned int
+RingWholeRecords(
+	struct lsadrv_ring_buffer *ringBuffer,
+	unsigned int   tail,
+	unsigned int   avail,
+	unsigned int   limit)
+{
+	unsigned int byteCount = 0;
+	unsigned int recSize;
+
+	if (!ringBuffer->compact) {
+		return rounddown(min(avail, limit), ringBuffer->recSize);
+	}
+	while (byteCount < avail) {
+		recSize = RingRecordSize(ringBuffer, tail + byteCount);
+		if (recSize == 0 || recSize > avail - byteCount ||
+		    recSize > limit - byteCount) {
+			break;
+		}
+		byteCount += recSize;
+	}
+	return byteCount;
+}
+
+/* number of whole records available, counting stops at limit */
 static unsigned int
+GetRingBufferRecordCount(struct lsadrv_ring_buffer *ringBuffer, unsigned int limit)
+{
+	unsigned int tail, avail, pos, count, recSize;
+
+	tail = smp_load_acquire(&ringBuffer->ctrl->Tail);
+	avail = smp_load_acquire(&ringBuffer->ctrl->Head) - tail;
+	if (avail > ringBuffer->capacity) {
+		avail = ringBuffer->capacity;
+	}
+	if (!ringBuffer->compact) {
+		return min(avail / ringBuffer->recSize, limit);
+	}
+	for (pos = 0, count = 0; count < limit && pos < avail; count++) {
+		recSize = RingRecordSize(ringBuffer, tail + pos);
+		if (recSize == 0 || recSize > avail - pos) {
+			break;
+		}
+		pos += recSize;
+	}
+	return count;
+}
+
+/* read whole records straight into the user buffer: bytes read or -EFAULT */
+static int
 ReadRingBuffer(
 	struct lsadrv_ring_buffer *ringBuffer,
-	unsigned char *readBuffer,
+	void          *readBuffer,	/* user space */
 	unsigned int   numberOfBytesToRead)
 {
 	unsigned int	byteCount;
-	unsigned long	flags;
+	unsigned int	head, tail;
 
 	if (numberOfBytesToRead > ringBuffer->totalSize) {
 		return 0;
 	}
 
-	//printk(">R ");
-	lsadrv_spin_lock(ringBuffer->spinLock, &flags);
-	byteCount = ringBuffer->currentSize;
-	if (byteCount == 0) {
-		lsadrv_spin_unlock(ringBuffer->spinLock, &flags);
-		return 0;
-	}
-
-	if (numberOfBytesToRead < byteCount) {
-		byteCount = numberOfBytesToRead;
-	}
-
-	/*
-	 * two cases.  Read either wraps or it doesn't.
-	 * Handle the non-wrapped case first
-	 */
-	if ((ringBuffer->outPtr + byteCount - 1) < (ringBuffer->buffer + ringBuffer->totalSize)) {
-		if (readBuffer) {
-			memcpy(readBuffer, ringBuffer->outPtr, byteCount);
+	for (;;) {
+		tail = smp_load_acquire(&ringBuffer->ctrl->Tail);
+		head = smp_load_acquire(&ringBuffer->ctrl->Head);
+		/* never split a record */
+		byteCount = RingWholeRecords(ringBuffer, tail, head - tail, numberOfBytesToRead);
+		if (byteCount == 0) {
+			return 0;
 		}
-		ringBuffer->outPtr += byteCount;
-      		if (ringBuffer->outPtr == ringBuffer->buffer + ringBuffer->totalSize) {
-			ringBuffer->outPtr = ringBuffer->buffer;
+
+		if (readBuffer &&
+		    CopyFromRingBufferToUser(ringBuffer, readBuffer, tail, byteCount)) {
+			/* leave the records in the ring */
+			return -EFAULT;
 		}
-	}
-	/* now handle the wrapped case */
-	else {
-		unsigned int fragSize;
 
-		fragSize = ringBuffer->buffer + ringBuffer->totalSize - ringBuffer->outPtr;
-		if (readBuffer) {
-			// get the first half of the read
-			memcpy(readBuffer, ringBuffer->outPtr, fragSize);
-			// now get the rest
-			memcpy(readBuffer + fragSize, ringBuffer->buffer, byteCount - fragSize);
+		/*
+		 * Release the space.  If the writer has dropped the oldest records
+		 * in the meantime, what we copied may be stale: start over.
+		 */
+		if (cmpxchg(&ringBuffer->ctrl->Tail, tail, tail + byteCount) == tail) {
+			break;
 		}
-		ringBuffer->outPtr = ringBuffer->buffer + byteCount - fragSize;
+		Trace(LSADRV_TRACE_FLOW, "R(overrun)");
 	}
- 
-	/*
-	 * update the current size of the ring buffer.  Use spinlock to insure
-	 * atomic operation.
-	 */
-	ringBuffer->currentSize -= byteCount;
-	lsadrv_spin_unlock(ringBuffer->spinLock, &flags);
 
-	//printk("<R%d ", byteCount);
-	Trace(LSADRV_TRACE_FLOW, "R(%d)", byteCount);
 	return byteCount;
 }
 
+/*
+ * after a read that left records behind, firstTime moves to the oldest
+ * unread one: V2 records carry the completion time of their urb, the
+ * others get 0 so the next completion stamps the ring.  An empty ring is
+ * left alone, the next write stamps it anyway.
+ */
+static void
+AdvanceFirstTime(struct lsadrv_ring_buffer *ringBuffer)
+{
+	unsigned int tail, head, offset;
+	u_int64_t stamp = 0;
+
+	tail = smp_load_acquire(&ringBuffer->ctrl->Tail);
+	head = smp_load_acquire(&ringBuffer->ctrl->Head);
+	if (head == tail) {
+		return;
+	}
+	if (ringBuffer->descSize == sizeof(struct lsadrv_iso_packet_desc_v2)) {
+		/* the descriptor leads compact records and follows the data of the others */
+		offset = offsetof(struct lsadrv_iso_packet_desc_v2, Timestamp);
+		if (!ringBuffer->compact) {
+			offset += ringBuffer->packetSize;
+		}
+		CopyFromRingBuffer(ringBuffer, (unsigned char *)&stamp, tail + offset, sizeof(stamp));
+	}
+	WRITE_ONCE(ringBuffer->firstTime, stamp);
+}
+
+/*
+ * append one record made of two pieces (either may be empty); compact
+ * records are padded to LSADRV_ISO_COMPACT_ALIGN
+ */
 static unsigned int
 WriteRingBuffer(
    	struct lsadrv_ring_buffer *ringBuffer,
-   	unsigned char *	writeBuffer,
-   	unsigned int 	numberOfBytesToWrite,
+   	const unsigned char *	firstBuffer,
+   	unsigned int 	firstSize,
+   	const unsigned char *	secondBuffer,
+   	unsigned int 	secondSize,
 	int		overWriteFlg)
 {
-	unsigned int byteCount;
-	unsigned int maxBytes;
-	unsigned long flags;
+	unsigned int head, tail;
+	unsigned int numberOfBytesToWrite = firstSize + secondSize;
 
-	//printk(">W%d ", numberOfBytesToWrite);
+	if (ringBuffer->compact) {
+		numberOfBytesToWrite = ALIGN(numberOfBytesToWrite, LSADRV_ISO_COMPACT_ALIGN);
+	}
 	//Trace(LSADRV_TRACE_FLOW, "W(%u)", numberOfBytesToWrite);
-	if (numberOfBytesToWrite > ringBuffer->totalSize) {
+	if (numberOfBytesToWrite > ringBuffer->capacity) {
 		return 0;
 	}
 
-	lsadrv_spin_lock(ringBuffer->spinLock, &flags);
-	maxBytes = ringBuffer->totalSize - ringBuffer->currentSize;
-	if (numberOfBytesToWrite > maxBytes) {
+	head = ringBuffer->head;	/* private copy, user space can't scribble on it */
+	tail = smp_load_acquire(&ringBuffer->ctrl->Tail);
+	while (numberOfBytesToWrite > ringBuffer->capacity - (head - tail)) {
+		unsigned int needBytes, dropBytes, dropCount, recSize;
 		if (!overWriteFlg) {
-			lsadrv_spin_unlock(ringBuffer->spinLock, &flags);
 			return 0;
 		}
-		else {
-			/* waste oldest data */
-			byteCount = numberOfBytesToWrite - maxBytes;
-			ringBuffer->outPtr += byteCount;
-			if (ringBuffer->outPtr >= ringBuffer->buffer + ringBuffer->totalSize) {
-				ringBuffer->outPtr -= ringBuffer->totalSize;
-			}
-			ringBuffer->currentSize -= byteCount;
-		}
-	}
-	
-	if (numberOfBytesToWrite > 0) {
-		/*
-		 * two cases.  Write either wraps or it doesn't.
-		 * Handle the non-wrapped case first
-		 */
-		if ((ringBuffer->inPtr + numberOfBytesToWrite - 1) < (ringBuffer->buffer + ringBuffer->totalSize))
-		{
-			if (writeBuffer) {
-				memcpy(ringBuffer->inPtr, writeBuffer, numberOfBytesToWrite);
-			}
-			ringBuffer->inPtr += numberOfBytesToWrite;
-			if (ringBuffer->inPtr == ringBuffer->buffer + ringBuffer->totalSize) {
-				ringBuffer->inPtr = ringBuffer->buffer;
+		/* waste oldest data, in whole records */
+		needBytes = numberOfBytesToWrite - (ringBuffer->capacity - (head - tail));
+		dropBytes = 0;
+		dropCount = 0;
+		while (dropBytes < needBytes) {
+			recSize = RingRecordSize(ringBuffer, tail + dropBytes);
+			if (recSize == 0 || recSize > (head - tail) - dropBytes) {
+				/* not a record boundary: drop everything */
+				dropBytes = head - tail;
+				dropCount++;
+				break;
 			}
+			dropBytes += recSize;
+			dropCount++;
 		}
-		/* now handle the wrapped case */
-		else {
-			unsigned int fragSize;
-
-			fragSize = ringBuffer->buffer + ringBuffer->totalSize - ringBuffer->inPtr;
-			if (writeBuffer) {
-				/* write the first fragment */
-				memcpy(ringBuffer->inPtr, writeBuffer, fragSize);
-				/* now write the rest */
-				memcpy(ringBuffer->buffer, writeBuffer + fragSize, numberOfBytesToWrite - fragSize);
-			}
-			ringBuffer->inPtr = ringBuffer->buffer + numberOfBytesToWrite - fragSize;
+		if (cmpxchg(&ringBuffer->ctrl->Tail, tail, tail + dropBytes) == tail) {
+			WRITE_ONCE(ringBuffer->ctrl->Dropped,
+				   ringBuffer->ctrl->Dropped + dropCount);
+			ringBuffer->droppedBytes += dropBytes;
+			break;
 		}
+		/* the reader moved the tail, check again */
+		tail = smp_load_acquire(&ringBuffer->ctrl->Tail);
 	}
 
-	/* 
-	 * update the current size of the ring buffer.
-	 */
-	ringBuffer->currentSize += numberOfBytesToWrite;
-
-	lsadrv_spin_unlock(ringBuffer->spinLock, &flags);
+	if (firstSize > 0 && firstBuffer) {
+		CopyToRingBuffer(ringBuffer, firstBuffer, head, firstSize);
+	}
+	if (secondSize > 0 && secondBuffer) {
+		CopyToRingBuffer(ringBuffer, secondBuffer, head + firstSize, secondSize);
+	}
 
-	/* wake up the waiting threads */
-	lsadrv_wake_up_interruptible(ringBuffer->waitq);
+	/* publish the data to the reader */
+	ringBuffer->head = head + numberOfBytesToWrite;
+	smp_store_release(&ringBuffer->ctrl->Head, ringBuffer->head);
 
-	//printk("<W%d ", numberOfBytesToWrite);
+	/* the caller wakes up the readers once per batch */
 	return numberOfBytesToWrite;
 }
 
@@ -263,16 +512,61 @@ static unsigned int
 GetRingBufferCurrentSize(struct lsadrv_ring_buffer *ringBuffer)
 {
 	unsigned int byteCount;
-	unsigned long flags;
+	unsigned int tail;
 
-	lsadrv_spin_lock(ringBuffer->spinLock, &flags); /* not necessary ? */
-	byteCount = ringBuffer->currentSize;
-	lsadrv_spin_unlock(ringBuffer->spinLock, &flags);
+	tail = smp_load_acquire(&ringBuffer->ctrl->Tail);
+	byteCount = smp_load_acquire(&ringBuffer->ctrl->Head) - tail;
+	/* the writer may have moved both counters between the two loads */
+	if (byteCount > ringBuffer->capacity) {
+		byteCount = ringBuffer->capacity;
+	}
 
-	Trace(LSADRV_TRACE_FLOW, "G(%d)", byteCount);
 	return byteCount;
 }
 
+/* packet statuses with their own counter in lsadrv_stats.packet_errors[] */
+const int lsadrv_stats_status[LSADRV_STATS_STATUSES - 1] = {
+	-EPROTO,	/* bit-stuff/internal error */
+	-EILSEQ,	/* CRC error */
+	-EOVERFLOW,	/* data overrun (babble) */
+	-EREMOTEIO,	/* short packet */
+	-ENOSR,		/* buffer underrun */
+	-ECOMM,		/* buffer overrun */
+	-EXDEV,		/* missed the frame */
+	-ETIMEDOUT,	/* no response */
+};
+
+static void
+CountPacketError(struct lsadrv_stats *stats, int status)
+{
+	unsigned int i;
+
+	for (i = 0; i < LSADRV_STATS_STATUSES - 1; i++) {
+		if (lsadrv_stats_status[i] == status) {
+			break;
+		}
+	}
+	stats->packet_errors[i]++;
+}
+
+/* count the age of the oldest record a reader took; firstTime as before the read */
+static void
+CountReadLatency(struct lsadrv_stats *stats, unsigned long long firstTime)
+{
+	unsigned long long usec;
+	unsigned int bucket;
+
+	if (firstTime == 0) {
+		return;
+	}
+	usec = (lsadrv_get_time_ns() - firstTime) / 1000;
+	bucket = usec ? ilog2(usec) + 1 : 0;
+	if (bucket >= LSADRV_STATS_LATENCY_BUCKETS) {
+		bucket = LSADRV_STATS_LATENCY_BUCKETS - 1;
+	}
+	stats->latency[bucket]++;
+}
+
 #if LSADRV_DEBUG
 static void dump(unsigned char *dat, unsigned int len)
 {
@@ -291,6 +585,111 @@ static void dump(unsigned char *dat, unsigned int len)
 }
 #endif /*LSADRV_DEBUG*/
 
+/*
+ * put one more parked urb in flight
+ * (from the completion handler: the stream lock keeps stop from missing it)
+ */
+static void
+SubmitIdleTransfer(struct lsadrv_iso_stream_object *stream)
+{
+	struct lsadrv_device *xdev = stream->xdev;
+	unsigned long flags;
+	unsigned int i;
+
+	lsadrv_spin_lock(xdev->streamLock, &flags);
+	if (!xdev->StopIsoStream && !xdev->CancelIsoStream && !xdev->unplugged) {
+		for (i = 0; i < stream->TransferCount; i++) {
+			struct lsadrv_iso_transfer_object *trans = &stream->transferObjects[i];
+			int ret;
+			if (trans->active) {
+				continue;
+			}
+			ret = lsadrv_usb_resubmit_urb(trans->urb, xdev->udev, stream->Anchor);
+			trace_lsadrv_urb_submit(xdev->devnum, trans->frame, ret);
+			if (ret) {
+				Info("adapt: submit_urb %d failed with error %d\n", trans->frame, ret);
+				break;
+			}
+			trans->active = 1;
+			stream->ActiveTransfers++;
+			stream->PendingTransfers++;
+			Trace(LSADRV_TRACE_STREAM, "adapt: %u urbs in flight\n", stream->ActiveTransfers);
+			break;
+		}
+	}
+	lsadrv_spin_unlock(xdev->streamLock, &flags);
+}
+
+/*
+ * adaptive mode: grow the number of urbs in flight when frames were skipped
+ * between two consecutive urbs or the completion came late, give one back
+ * after a long quiet period.
+ *   return: 0 if this urb should be parked instead of resubmitted
+ */
+static int
+AdaptIsoStream(
+	struct lsadrv_iso_stream_object *stream,
+	struct lsadrv_iso_transfer_object *trans)
+{
+	struct lsadrv_device *xdev = stream->xdev;
+	unsigned long long now = lsadrv_get_time_ns();
+	int startFrame = lsadrv_get_isoc_start_frame(trans->urb);
+	int trouble = 0;
+	unsigned long flags;
+
+	if (stream->LastCompletion) {
+		int gap = startFrame - stream->NextStartFrame;
+		if (gap > 0 && gap < STREAM_FRAME_GAP_WINDOW) {
+			Trace(LSADRV_TRACE_STREAM, "adapt: %d frames skipped\n", gap);
+			trouble = 1;
+		}
+		/* full speed: one packet per 1ms frame */
+		if (now - stream->LastCompletion > 2ULL * stream->FramesPerBuffer * 1000000ULL) {
+			Trace(LSADRV_TRACE_STREAM, "adapt: late completion (%llu us)\n",
+				(now - stream->LastCompletion) / 1000);
+			trouble = 1;
+		}
+	}
+	stream->NextStartFrame = startFrame + stream->FramesPerBuffer;
+	stream->LastCompletion = now;
+
+	if (trouble) {
+		stream->QuietCompletions = 0;
+		if (stream->ActiveTransfers < stream->TransferCount) {
+			SubmitIdleTransfer(stream);
+		}
+		return 1;
+	}
+
+	if (++stream->QuietCompletions < STREAM_ADAPT_QUIET_PERIOD ||
+	    stream->ActiveTransfers <= STREAM_TRANSFER_MIN) {
+		return 1;
+	}
+
+	/* park this urb */
+	stream->QuietCompletions = 0;
+	lsadrv_spin_lock(xdev->streamLock, &flags);
+	trans->active = 0;
+	stream->ActiveTransfers--;
+	stream->PendingTransfers--;
+	lsadrv_spin_unlock(xdev->streamLock, &flags);
+	Trace(LSADRV_TRACE_STREAM, "adapt: %u urbs in flight\n", stream->ActiveTransfers);
+	return 0;
+}
+
+/* hand a received packet to the in-kernel decoder, report what it found */
+static void
+DecodePacket(struct lsadrv_iso_stream_object *stream, const unsigned char *data, unsigned int length)
+{
+	struct lsadrv_contact contacts[LSADRV_DECODER_MAX_CONTACTS];
+	int count;
+
+	count = stream->Decoder->decode(stream->DecoderState, data, length, contacts);
+	if (count >= 0) {
+		lsadrv_report_contacts(stream->xdev, contacts, count);
+	}
+}
+
 /*
  * Isochronous transfer urb completion routine
  */
@@ -305,6 +704,7 @@ lsadrv_isoc_handler(void *context, int status)
 	unsigned char *src;
 	struct lsadrv_iso_packet_desc *mydesc;
 	unsigned int recSize;
+	unsigned int written;
 	unsigned long flags;
 
 	//if (status == 0) {
@@ -313,7 +713,6 @@ lsadrv_isoc_handler(void *context, int status)
 	//else {
 	//	lsadrv_printk(">>hdr(%d):status=%d\n", trans->frame, status);
 	//}
-	Trace(LSADRV_TRACE_STREAM, ">>isoc_handler %d\n", trans->frame);
 
 	stream = trans->stream;
 	if (stream == NULL) {
@@ -328,6 +727,8 @@ lsadrv_isoc_handler(void *context, int status)
 		Trace(LSADRV_TRACE_STREAM, "<<isoc_handler %d\n", trans->frame);
 		return;
 	}
+	trace_lsadrv_urb_complete(xdev->devnum, trans->frame, status, stream->FramesPerBuffer);
+	xdev->stats.urbs++;
 
 	/* report error status */
 	if (status != 0) {
@@ -372,12 +773,24 @@ lsadrv_isoc_handler(void *context, int status)
 	}
 
 	num_packets = stream->FramesPerBuffer;
-	recSize = stream->PacketSize + sizeof(struct lsadrv_iso_packet_desc); /* data + packet descriptor */
+	recSize = stream->PacketSize + stream->DescSize; /* data + packet descriptor */
 	for (i = 0; i < num_packets; i++) {
 		src = trans->data + i * recSize;
 		mydesc = (struct lsadrv_iso_packet_desc *)(src + stream->PacketSize);
 		lsadrv_get_isoc_desc(trans->urb, i, &mydesc->Status, &mydesc->Length);
 	}
+	if (stream->Flags & LSADRV_ISO_FLAG_RECORD_V2) {
+		/* one packet per frame */
+		unsigned int startFrame = lsadrv_get_isoc_start_frame(trans->urb);
+		unsigned long long now = lsadrv_get_time_ns();
+		for (i = 0; i < num_packets; i++) {
+			struct lsadrv_iso_packet_desc_v2 *desc2;
+			desc2 = (struct lsadrv_iso_packet_desc_v2 *)(trans->data + i * recSize + stream->PacketSize);
+			desc2->FrameNumber = startFrame + i;
+			desc2->Reserved = 0;
+			desc2->Timestamp = now;
+		}
+	}
 
 	if (status == -ENOSR ||
 	    status == -EXDEV ||
@@ -399,6 +812,10 @@ lsadrv_isoc_handler(void *context, int status)
 #if LSADRV_DEBUG
 int dump_flg = 0;
 #endif /*LSADRV_DEBUG*/
+		int wasEmpty = GetRingBufferCurrentSize(stream->RingBuffer) == 0;
+		unsigned int dropped = READ_ONCE(stream->RingBuffer->ctrl->Dropped);
+		unsigned long droppedBytes = stream->RingBuffer->droppedBytes;
+		written = 0;
 		for (i = 0; i < num_packets; i++) {
 			src = trans->data + i * recSize;
 			mydesc = (struct lsadrv_iso_packet_desc *)(src + stream->PacketSize);
@@ -407,6 +824,7 @@ int dump_flg = 0;
 			//Trace(LSADRV_TRACE_FLOW, "[%d]", mydesc->Length);
 			if (mydesc->Status == 0) {
 				if (mydesc->Length > 0) {
+					xdev->stats.packets++;
 #if LSADRV_DEBUG
 					if (trans->trans_count <= 100) {
 						lsadrv_printk("%d: len=%d\n", trans->trans_count, mydesc->Length);
@@ -415,18 +833,56 @@ int dump_flg = 0;
 				//		dump_flg = 1;
 					}
 #endif /*LSADRV_DEBUG*/
-	      				WriteRingBuffer(stream->RingBuffer,
-						src,
-						recSize,
-						1);	/* overwrite */
+					if (stream->Decoder) {
+						DecodePacket(stream, src, mydesc->Length);
+					}
+					if (stream->Flags & LSADRV_ISO_FLAG_COMPACT) {
+						/* descriptor first, only the received bytes */
+						written += WriteRingBuffer(stream->RingBuffer,
+							(unsigned char *)mydesc,
+							stream->DescSize,
+							src,
+							mydesc->Length,
+							1);	/* overwrite */
+					}
+					else {
+	      					written += WriteRingBuffer(stream->RingBuffer,
+							src,
+							recSize,
+							NULL,
+							0,
+							1);	/* overwrite */
+					}
 				}
 			}
 			/* This is normally not interesting to the user, unless you are really debugging something */
 			else {
   				stream->TotalDataErrorCount++;
+				CountPacketError(&xdev->stats, mydesc->Status);
 				Trace(LSADRV_TRACE_FLOW, "Iso frame %d of USB has error %d\n", i, mydesc->Status);
 			}
 		}
+		if (written) {
+			unsigned int fill = GetRingBufferCurrentSize(stream->RingBuffer);
+			unsigned int total = READ_ONCE(stream->RingBuffer->ctrl->Dropped);
+			if (total != dropped) {
+				trace_lsadrv_ring_drop(xdev->devnum, total - dropped, total);
+			}
+			trace_lsadrv_ring_write(xdev->devnum, written, fill);
+			xdev->stats.bytes_written += written;
+			xdev->stats.bytes_dropped += stream->RingBuffer->droppedBytes - droppedBytes;
+			if (fill > xdev->stats.max_fill) {
+				xdev->stats.max_fill = fill;
+			}
+			if (wasEmpty || READ_ONCE(stream->RingBuffer->firstTime) == 0) {
+				/* starts the latency clock of batched readers */
+				WRITE_ONCE(stream->RingBuffer->firstTime, lsadrv_get_time_ns());
+			}
+			/* one wakeup per urb */
+			trace_lsadrv_reader_wakeup(xdev->devnum, fill);
+			xdev->stats.wakeups++;
+			lsadrv_wake_up_interruptible(stream->RingBuffer->waitq);
+		}
 #if LSADRV_DEBUG
 		if (dump_flg) {
 			lsadrv_printk("%d: alldump: trans:data=0x%p,len=%u\n",
@@ -445,14 +901,17 @@ int dump_flg = 0;
 	)
 	{
 		int ret;
+		if (stream->Adaptive && !AdaptIsoStream(stream, trans)) {
+			Trace(LSADRV_TRACE_STREAM, "<<isoc_handler %d: parked\n", trans->frame);
+			return;
+		}
 		/* resubmit urb */
-		Trace(LSADRV_TRACE_STREAM, "isoc_handler %d: submit urb\n", trans->frame);
 		//printk("submit(%d)\n", trans->frame);
-		ret = lsadrv_usb_resubmit_urb(trans->urb, xdev->udev);
+		ret = lsadrv_usb_resubmit_urb(trans->urb, xdev->udev, stream->Anchor);
+		trace_lsadrv_urb_submit(xdev->devnum, trans->frame, ret);
 		if (!ret) {
 			//lsadrv_modunlock(xdev);
 			//printk("<<hdr(%d)\n", trans->frame);
-			Trace(LSADRV_TRACE_STREAM, "<<isoc_handler %d\n", trans->frame);
 			return;
 		}
 		Err("submit_urb %d:0x%p failed with error %d\n", trans->frame, trans->urb, ret);
@@ -488,7 +947,12 @@ int dump_flg = 0;
 	}
 
 	Trace(LSADRV_TRACE_STREAM, "isoc_handler: stopping transfer %d\n", trans->frame);
-	stream->PendingTransfers--;
+	trans->active = 0;
+	/* AdaptIsoStream counts only the urbs still in flight */
+	stream->ActiveTransfers--;
+	if (--stream->PendingTransfers == 0) {
+		lsadrv_complete(stream->Idle);
+	}
 
 	//printk("h:unlocking\n");
 	//lsadrv_modunlock(xdev);
@@ -503,50 +967,40 @@ int dump_flg = 0;
 }
 
 
+/*
+ * kill the urbs in flight; usb_kill_anchored_urbs() returns once their
+ * completion handlers ran, so the wait for Idle is only a safety net
+ */
 static void
 WaitForIsoStreamDone(struct lsadrv_iso_stream_object *stream)
 {
-	struct lsadrv_ring_buffer *ringBuffer;
-	//DECLARE_WAITQUEUE(wait, current);
-	unsigned char waitbuf[64];	/* sufficient size */
-	#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0))
-	wait_queue_entry_t *wait = (wait_queue_entry_t *) waitbuf;
-	#else
-	wait_queue_t *wait = (wait_queue_t *) waitbuf;
-	#endif
-	struct lsadrv_device *xdev;
+	struct lsadrv_device *xdev = stream->xdev;
 	unsigned int pendingTransfers;
+	unsigned long flags;
 
-	if (stream == NULL || (ringBuffer = stream->RingBuffer) == NULL) {
+	lsadrv_usb_kill_anchored_urbs(stream->Anchor);
+
+	lsadrv_spin_lock(xdev->streamLock, &flags);
+	pendingTransfers = stream->PendingTransfers;
+	lsadrv_spin_unlock(xdev->streamLock, &flags);
+	if (pendingTransfers == 0) {
 		return;
 	}
+	Trace(LSADRV_TRACE_STREAM, "waiting stream done: transfers=%d\n", pendingTransfers);
+	if (!lsadrv_wait_for_completion_timeout(stream->Idle, lsadrv_msec_to_jiffies(STREAM_STOP_TIMEOUT))) {
+		Err("stop_iso_stream: %u transfers did not complete\n", pendingTransfers);
+	}
+}
 
-	lsadrv_init_waitqueue_entry(waitbuf, sizeof(waitbuf));
-
-	xdev = stream->xdev;
-
-	//printk(">>Wait\n");
-	//printk("add_wait_queue\n");
-	lsadrv_add_wait_queue(ringBuffer->waitq, wait);
-	lsadrv_set_current_state(TASK_INTERRUPTIBLE);
-	while (1) {
-		unsigned long flags;
-		//lsadrv_modlock(xdev);
-		lsadrv_spin_lock(xdev->streamLock, &flags);
-		pendingTransfers = stream->PendingTransfers;
-		lsadrv_spin_unlock(xdev->streamLock, &flags);
-		//lsadrv_modunlock(xdev);
-		if (pendingTransfers == 0) {
-			break;
-		}
-		Trace(LSADRV_TRACE_STREAM, "waiting stream done: transfers=%d\n", pendingTransfers);
-		//printk("sched\n");
-		lsadrv_schedule();
+static void
+DetachDecoder(struct lsadrv_iso_stream_object *stream)
+{
+	if (stream->Decoder) {
+		stream->Decoder->close(stream->DecoderState);
+		lsadrv_put_decoder(stream->Decoder);
+		stream->Decoder = NULL;
+		stream->DecoderState = NULL;
 	}
-	lsadrv_set_current_state(TASK_RUNNING);
-	//printk("remove_wait_queue\n");
-	lsadrv_remove_wait_queue(ringBuffer->waitq, wait);
-	//printk("<<Wait\n");
 }
 
 static void
@@ -559,28 +1013,193 @@ FreeStreamObject(struct lsadrv_iso_stream_object *stream)
 	}
 
 	Trace(LSADRV_TRACE_MEMORY, "FreeStreamObject\n");
-	/* free transfer objects */
+	/* free transfer objects (no urb is in flight any more) */
 	if (stream->transferObjects) {
 		/* free transfer buffers and urbs */
 		for (i = 0; i < stream->TransferCount; i++) {
 			struct lsadrv_iso_transfer_object *trans = &stream->transferObjects[i];
-			lsadrv_usb_unlink_urb(trans->urb);
 			lsadrv_usb_free_urb(trans->urb);
-			lsadrv_free(trans->data);
+			if (stream->Coherent) {
+				if (trans->data) {
+					lsadrv_usb_free_coherent(stream->xdev->udev,
+						stream->TransferBufferLength, trans->data, trans->dma);
+				}
+			}
+			else {
+				lsadrv_free(trans->data);
+			}
 		}
 		lsadrv_free(stream->transferObjects);
 	}
 
+	DetachDecoder(stream);
+
 	/* free ring buffer */
    	FreeRingBuffer(stream->RingBuffer);
 
+	lsadrv_free_usb_anchor(stream->Anchor);
+	lsadrv_free_completion(stream->Idle);
+
 	/* free stream object */
 	lsadrv_free(stream);
 }
 
-/* start isochronous stream */
-int
-lsadrv_start_iso_stream(
+/* stream object with its ring, transfer buffers and urbs */
+static struct lsadrv_iso_stream_object *
+AllocStreamObject(
+	struct lsadrv_device *xdev,
+	unsigned int pipe,
+	unsigned int PacketSize,
+	unsigned int PacketCount,
+	unsigned int FramesPerBuffer,
+	unsigned int transferCount,
+	unsigned int descSize,
+	unsigned int recSize,
+	unsigned int Flags)
+{
+	struct usb_device *udev = xdev->udev;
+	struct lsadrv_iso_stream_object *stream;
+	unsigned int i;
+
+	/* allocate stream object */
+	stream = lsadrv_malloc(sizeof(struct lsadrv_iso_stream_object));
+	if (!stream) {
+		return NULL;
+	}
+	memset(stream, 0, sizeof(*stream));
+
+	stream->xdev = xdev;
+	stream->Pipe = pipe;
+	stream->PacketSize = PacketSize;
+	stream->PacketCount = PacketCount;
+	stream->RecordSize = recSize;
+	stream->DescSize = descSize;
+	stream->Flags = Flags;
+	stream->TransferBufferLength = (PacketSize + descSize) * FramesPerBuffer;
+	stream->Coherent = lsadrv_coherent;
+	stream->FramesPerBuffer = FramesPerBuffer;
+	stream->TransferCount = transferCount;
+	stream->PendingTransfers = 0;
+	stream->ActiveTransfers = 0;
+	stream->TotalDataErrorCount = 0;
+	stream->RingBuffer = NULL;
+	stream->transferObjects = NULL;
+
+	lsadrv_init_usb_anchor(&stream->Anchor);
+	lsadrv_init_completion(&stream->Idle);
+	if (!stream->Anchor || !stream->Idle) {
+		FreeStreamObject(stream);
+		return NULL;
+	}
+
+	/* allocate ring buffer */
+   	stream->RingBuffer = AllocRingBuffer(PacketCount * recSize, PacketSize, descSize, recSize, Flags,
+					     &xdev->stream_wait);
+	if (!stream->RingBuffer) {
+		FreeStreamObject(stream);
+		return NULL;
+	}
+
+	/* allocate transfer objects */
+   	stream->transferObjects = lsadrv_malloc(sizeof(struct lsadrv_iso_transfer_object) * transferCount);
+	if (!stream->transferObjects) {
+		FreeStreamObject(stream);
+		return NULL;
+	}
+	memset(stream->transferObjects, 0, sizeof(struct lsadrv_iso_transfer_object) * transferCount);
+
+	/* allocate transfer buffers and urbs */
+	for (i = 0; i < transferCount; i++) {
+		struct lsadrv_iso_transfer_object *trans = &stream->transferObjects[i];
+
+		trans->frame = i;
+		trans->stream = stream;
+
+		/* allocate transfer buffers */
+		if (stream->Coherent) {
+			trans->data = lsadrv_usb_alloc_coherent(udev, stream->TransferBufferLength, &trans->dma);
+		}
+		else {
+			trans->data = lsadrv_malloc(stream->TransferBufferLength);
+		}
+		if (!trans->data) {
+			FreeStreamObject(stream);
+			return NULL;
+		}
+
+		/* allocate urb */
+		trans->urb = lsadrv_usb_alloc_urb(stream->FramesPerBuffer);
+		if (trans->urb == NULL) {
+			Err("Failed to allocate urb %d\n", i);
+			FreeStreamObject(stream);
+			return NULL;
+		}
+	}
+	return stream;
+}
+
+/*
+ * the stream parked by the last stop, ready to restart, if its geometry
+ * matches; otherwise it is freed.  A ring still mapped by user space is
+ * replaced, so the old mapping never sees the new stream's data.
+ */
+static struct lsadrv_iso_stream_object *
+TakeParkedStream(
+	struct lsadrv_device *xdev,
+	unsigned int pipe,
+	unsigned int PacketSize,
+	unsigned int PacketCount,
+	unsigned int FramesPerBuffer,
+	unsigned int transferCount,
+	unsigned int Flags)
+{
+	struct lsadrv_iso_stream_object *stream = xdev->parkedStream;
+	unsigned int i;
+
+	if (stream == NULL) {
+		return NULL;
+	}
+	xdev->parkedStream = NULL;
+
+	if (stream->Pipe != pipe || stream->PacketSize != PacketSize ||
+	    stream->PacketCount != PacketCount || stream->FramesPerBuffer != FramesPerBuffer ||
+	    stream->TransferCount != transferCount || stream->Flags != Flags) {
+		Trace(LSADRV_TRACE_STREAM, "start_iso_stream: geometry changed, freeing the parked stream\n");
+		FreeStreamObject(stream);
+		return NULL;
+	}
+
+	if (RingBufferMapped(stream->RingBuffer)) {
+		FreeRingBuffer(stream->RingBuffer);
+		stream->RingBuffer = AllocRingBuffer(PacketCount * stream->RecordSize, PacketSize,
+						     stream->DescSize, stream->RecordSize, Flags,
+						     &xdev->stream_wait);
+		if (!stream->RingBuffer) {
+			FreeStreamObject(stream);
+			return NULL;
+		}
+	}
+	else {
+		ResetRingBuffer(stream->RingBuffer);
+	}
+
+	stream->PendingTransfers = 0;
+	stream->ActiveTransfers = 0;
+	stream->NextStartFrame = 0;
+	stream->LastCompletion = 0;
+	stream->QuietCompletions = 0;
+	stream->TotalDataErrorCount = 0;
+	for (i = 0; i < stream->TransferCount; i++) {
+		stream->transferObjects[i].active = 0;
+	}
+	lsadrv_reinit_completion(stream->Idle);
+	Trace(LSADRV_TRACE_STREAM, "start_iso_stream: reusing the parked stream\n");
+	return stream;
+}
+
+/* start isochronous stream (stream_mutex held) */
+static int
+StartIsoStream(
 	struct lsadrv_device *xdev,
 	unsigned int ep,	/* endpoint address(1-15) + direction(0x80 for IN) */
 	unsigned int PacketSize, /* ISO packet size. how much data is transferred each frame.
@@ -588,15 +1207,20 @@ lsadrv_start_iso_stream(
 	 			  */
 	unsigned int PacketCount, /* Total number of ISO packets to transfer. */
 	unsigned int FramesPerBuffer,
-	unsigned int BufferCount)
+	unsigned int BufferCount,
+	unsigned int Flags)	/* LSADRV_ISO_FLAG_* */
 {
 	struct usb_device *udev = xdev->udev;
 	unsigned int pipe;
 	unsigned int max_packet_size;
 	struct lsadrv_iso_stream_object *stream = NULL;
 	unsigned int transferCount;
+	unsigned int activeCount;
+	int adaptive;
+	unsigned int descSize;
 	unsigned int recSize;
 	unsigned int i;
+	unsigned long flags;
 	
 	Trace(LSADRV_TRACE_STREAM, ">> start_iso_stream\n");
 
@@ -631,96 +1255,96 @@ lsadrv_start_iso_stream(
 		return -EINVAL;
 	}
 
-#ifdef STREAM_TRANSFER_COUNT
-	transferCount = min(BufferCount, STREAM_TRANSFER_COUNT);
-#else //STREAM_TRANSFER_COUNT
-	transferCount = BufferCount;
-#endif //STREAM_TRANSFER_COUNT
+	adaptive = (BufferCount & LSADRV_ISO_ADAPTIVE_BUFFERS) != 0;
+	BufferCount &= ~LSADRV_ISO_ADAPTIVE_BUFFERS;
+	activeCount = clamp(BufferCount, STREAM_TRANSFER_MIN, STREAM_TRANSFER_MAX);
+	/* adaptive mode keeps spare urbs ready to go */
+	transferCount = adaptive ? STREAM_TRANSFER_MAX : activeCount;
 
 	/* buffer size per packet (including packet descriptor) */
-	recSize = PacketSize + sizeof(struct lsadrv_iso_packet_desc); /* data + packet descriptor */
-
-	/* allocate stream object */
-	stream = lsadrv_malloc(sizeof(struct lsadrv_iso_stream_object));
-	if (!stream) {
-		return -ENOMEM;
+	if (Flags & ~(LSADRV_ISO_FLAG_RECORD_V2 | LSADRV_ISO_FLAG_COMPACT)) {
+		Info("%s: unknown flags 0x%x\n", __func__, Flags);
+		return -EINVAL;
 	}
-	memset(stream, 0, sizeof(*stream));
-
-	stream->xdev = xdev;
-	stream->PacketSize = PacketSize;
-	stream->TransferBufferLength = recSize * FramesPerBuffer;
-	stream->FramesPerBuffer = FramesPerBuffer;
-	stream->BufferCount = BufferCount;
-	stream->TransferCount = transferCount;
-	stream->PendingTransfers = 0;
-	stream->TotalDataErrorCount = 0;
-	stream->RingBuffer = NULL;
-	stream->transferObjects = NULL;
-
-
-	/* allocate ring buffer */
-   	stream->RingBuffer = AllocRingBuffer(PacketCount * recSize);
-	if (!stream->RingBuffer) {
-		lsadrv_free(stream);
-		return -ENOMEM;
+	if (Flags & LSADRV_ISO_FLAG_RECORD_V2) {
+		descSize = sizeof(struct lsadrv_iso_packet_desc_v2);
 	}
-
-	/* allocate transfer objects */
-   	stream->transferObjects = lsadrv_malloc(sizeof(struct lsadrv_iso_transfer_object) * transferCount);
-	if (!stream->transferObjects) {
-		FreeRingBuffer(stream->RingBuffer);
-		lsadrv_free(stream);
-		return -ENOMEM;
+	else {
+		descSize = sizeof(struct lsadrv_iso_packet_desc);
+	}
+	recSize = PacketSize + descSize; /* data + packet descriptor */
+	if (Flags & LSADRV_ISO_FLAG_COMPACT) {
+		/* largest compact record */
+		recSize = ALIGN(recSize, LSADRV_ISO_COMPACT_ALIGN);
 	}
-	memset(stream->transferObjects, 0, sizeof(struct lsadrv_iso_transfer_object) * transferCount);
-
-	/* allocate transfer buffers and urbs */
-	for (i = 0; i < transferCount; i++) {
-		struct lsadrv_iso_transfer_object *trans = &stream->transferObjects[i];
-
-		trans->frame = i;
-		trans->stream = stream;
 
-		/* allocate transfer buffers */
-		trans->data = lsadrv_malloc(stream->TransferBufferLength);
-		if (!trans->data) {
-			FreeStreamObject(stream);
-			return -ENOMEM;
-		}
+	/*
+	 * ring size: full speed gives one packet per 1ms frame, so max_history
+	 * msec is as many records.  The ring is vmalloc'ed, so a long history
+	 * needs no physically contiguous memory.
+	 */
+	if (PacketCount > lsadrv_max_history) {
+		Info("%s: ring of %u packets limited to %u (max_history)\n", __func__, PacketCount, lsadrv_max_history);
+		PacketCount = lsadrv_max_history;
+	}
+	/* the ring size is rounded up to a power of two and must fit the 32bit counters */
+	if (PacketCount == 0 || PacketCount > (1U << 31) / recSize) {
+		Info("%s: invalid ring size: %u packets\n", __func__, PacketCount);
+		return -EINVAL;
+	}
 
-		/* allocate urb */
-		trans->urb = lsadrv_usb_alloc_urb(stream->FramesPerBuffer);
-		if (trans->urb == NULL) {
-			Err("Failed to allocate urb %d\n", i);
-			FreeStreamObject(stream);
+	/* the last stream's resources if the geometry is the same, else new ones */
+	stream = TakeParkedStream(xdev, pipe, PacketSize, PacketCount, FramesPerBuffer, transferCount, Flags);
+	if (stream == NULL) {
+		stream = AllocStreamObject(xdev, pipe, PacketSize, PacketCount, FramesPerBuffer,
+					   transferCount, descSize, recSize, Flags);
+		if (stream == NULL) {
 			return -ENOMEM;
 		}
 	}
-
+	stream->BufferCount = BufferCount;
+	stream->Adaptive = adaptive;
 
 	/* init URB structure */
 	for (i = 0; i < transferCount; i++) {
 		struct lsadrv_iso_transfer_object *trans = &stream->transferObjects[i];
 		lsadrv_fill_isoc_urb(trans->urb, udev, pipe, trans, 
-			trans->data, stream->FramesPerBuffer, max_packet_size, recSize);
+			trans->data, stream->Coherent ? &trans->dma : NULL,
+			stream->FramesPerBuffer, max_packet_size, PacketSize + descSize);
 	}
 
+	/* attach the in-kernel decoder; without one user space decodes the ring */
+	if (lsadrv_decoder_name[0]) {
+		stream->Decoder = lsadrv_get_decoder(lsadrv_decoder_name);
+		if (stream->Decoder == NULL) {
+			Info("%s: decoder '%s' is not loaded\n", __func__, lsadrv_decoder_name);
+		}
+		else if ((stream->DecoderState = stream->Decoder->open(PacketSize)) == NULL) {
+			Info("%s: decoder '%s' failed to open\n", __func__, lsadrv_decoder_name);
+			lsadrv_put_decoder(stream->Decoder);
+			stream->Decoder = NULL;
+		}
+	}
+
+	lsadrv_spin_lock(xdev->streamLock, &flags);
 	xdev->stream = stream;
+	lsadrv_spin_unlock(xdev->streamLock, &flags);
 	xdev->StopIsoStream = 0;
 	xdev->CancelIsoStream = 0;
 	xdev->statusStreamStopReason = 0;
 	xdev->LastFailedStreamUrbStatus = 0;
 
 	/* submit urbs */
-	for (i = 0; i < transferCount; i++) {
+	for (i = 0; i < activeCount; i++) {
 		struct lsadrv_iso_transfer_object *trans = &stream->transferObjects[i];
 		int ret;
-		ret = lsadrv_usb_submit_urb(trans->urb);
+		ret = lsadrv_usb_submit_urb(trans->urb, stream->Anchor);
+		trace_lsadrv_urb_submit(xdev->devnum, trans->frame, ret);
 		if (!ret) {
-			unsigned long flags;
 			lsadrv_spin_lock(xdev->streamLock, &flags);
 			//lsadrv_modlock(xdev);
+			trans->active = 1;
+			stream->ActiveTransfers++;
 			stream->PendingTransfers++;
 			lsadrv_spin_unlock(xdev->streamLock, &flags);
 			//lsadrv_modunlock(xdev);
@@ -737,7 +1361,29 @@ lsadrv_start_iso_stream(
 	return 0;
 }
 
-int lsadrv_stop_iso_stream(struct lsadrv_device *xdev)
+/* start isochronous stream */
+int
+lsadrv_start_iso_stream(
+	struct lsadrv_device *xdev,
+	unsigned int ep,
+	unsigned int PacketSize,
+	unsigned int PacketCount,
+	unsigned int FramesPerBuffer,
+	unsigned int BufferCount,
+	unsigned int Flags)
+{
+	int ret;
+
+	/* against a stop from disconnect, which may free the parked stream */
+	mutex_lock(&xdev->stream_mutex);
+	ret = StartIsoStream(xdev, ep, PacketSize, PacketCount, FramesPerBuffer, BufferCount, Flags);
+	mutex_unlock(&xdev->stream_mutex);
+	return ret;
+}
+
+/* stop isochronous stream (stream_mutex held) */
+static int
+StopIsoStream(struct lsadrv_device *xdev)
 {
 	unsigned long flags;
 	//printk(">>stop_iso_stream\n");
@@ -751,37 +1397,54 @@ int lsadrv_stop_iso_stream(struct lsadrv_device *xdev)
 	//lsadrv_modunlock(xdev);
 	if (xdev->stream) {
 		struct lsadrv_iso_stream_object *stream = xdev->stream;
-		int transferCount = stream->TransferCount;
-		int i;
-		for (i = 0; i < transferCount; i++) {
-			struct lsadrv_iso_transfer_object *trans = &stream->transferObjects[i];
-//			printk("locking(%d)", trans->frame);
-//			lsadrv_modlock(xdev);
-			//printk("unlink(%d)", trans->frame);
-			lsadrv_usb_unlink_urb(trans->urb);
-//			printk("unlocking(%d)", trans->frame);
-//			lsadrv_modunlock(xdev);
-		}
-		WaitForIsoStreamDone(xdev->stream);
-		FreeStreamObject(xdev->stream);
+		WaitForIsoStreamDone(stream);
+		DetachDecoder(stream);
+		lsadrv_spin_lock(xdev->streamLock, &flags);
 		xdev->stream = NULL;
+		lsadrv_spin_unlock(xdev->streamLock, &flags);
+		/* keep the resources for the next start (urbs and buffers are idle now) */
+		FreeStreamObject(xdev->parkedStream);
+		xdev->parkedStream = stream;
+	}
+	if (xdev->unplugged) {
+		FreeStreamObject(xdev->parkedStream);
+		xdev->parkedStream = NULL;
 	}
 	xdev->iso_init = 0;
+	/* pollers of the character device see the stream gone */
+	lsadrv_wake_up_interruptible(&xdev->stream_wait);
 	//printk("<<stop_iso_stream\n");
 	Trace(LSADRV_TRACE_STREAM, "<< stop_iso_stream\n");
 	return 0;
 }
 
-int lsadrv_read_iso_buffer(
+/* stop isochronous stream; the ioctl and disconnect may both call it */
+int lsadrv_stop_iso_stream(struct lsadrv_device *xdev)
+{
+	int ret;
+
+	mutex_lock(&xdev->stream_mutex);
+	ret = StopIsoStream(xdev);
+	mutex_unlock(&xdev->stream_mutex);
+	return ret;
+}
+
+/*
+ * wait until the ring has data, the stream stops or the timeout expires
+ * With minRecords > 1 "has data" means minRecords whole records, or any
+ * record once the oldest unread one is maxLatency old.  Writers wake us
+ * once per urb, so each check costs at most one wakeup per completion.
+ *   return: 0 or the stream stop reason; *pSize: bytes available (0 if none)
+ */
+static int
+WaitForRingData(
 	struct lsadrv_device *xdev,
-	unsigned int   PacketCount,
-	unsigned int   PacketSize,
-	unsigned char* dataBuffer,
-	unsigned int*  pBytesRead,
-	signed long    timeout)		/* jiffies */
+	struct lsadrv_ring_buffer *ringBuffer,
+	unsigned int  *pSize,
+	signed long    timeout,		/* jiffies */
+	unsigned int   minRecords,	/* wake up when this many records are ready, */
+	unsigned int   maxLatency)	/* or the oldest one is this old (usec, 0: no limit) */
 {
-	struct lsadrv_iso_stream_object *stream = xdev->stream;
-	struct lsadrv_ring_buffer *ringBuffer;
 	//DECLARE_WAITQUEUE(wait, current);
 	unsigned char waitbuf[64];	/* sufficient size */
 	#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0))
@@ -789,43 +1452,14 @@ int lsadrv_read_iso_buffer(
 	#else
 	wait_queue_t *wait = (wait_queue_t *) waitbuf;
 	#endif
-	unsigned int recSize = PacketSize + sizeof(struct lsadrv_iso_packet_desc);
-	unsigned int bytesToRead = PacketCount * recSize;
-	unsigned int bytesRead = 0;
-	unsigned int ret = 0;
+	int ret = 0;
 	unsigned int size = 0;
 
-//	Trace(LSADRV_TRACE_READ, ">> read_iso_buffer\n");
-
-	*pBytesRead = 0;
-
-	if (stream == NULL || (ringBuffer = stream->RingBuffer) == NULL) {
-		Err("read_iso_buffer: buffer is absent\n");
-		return -EFAULT;
-	}
-
-	if (stream->PacketSize != PacketSize) {
-		Err("read_iso_buffer: PacketSize mismatch\n");
-		return -EINVAL;
-	}
-
-	// check error status
-	if (xdev->statusStreamStopReason != 0 || xdev->StopIsoStream || xdev->CancelIsoStream) {
-		if (xdev->statusStreamStopReason != 0) {
-			Info("read_iso_buffer: stop reason=%d\n", xdev->statusStreamStopReason);
-			return xdev->statusStreamStopReason;
-		}
-		else {
-			Err("read_iso_buffer: stream is stopped\n");
-			return -EFAULT;
-		}
-	}
-
 	lsadrv_init_waitqueue_entry(waitbuf, sizeof(waitbuf));
 
 	lsadrv_add_wait_queue(ringBuffer->waitq, wait);
-	lsadrv_set_current_state(TASK_INTERRUPTIBLE);
 	while (timeout) {
+		lsadrv_set_current_state(TASK_INTERRUPTIBLE);
 		if (xdev->statusStreamStopReason != 0) {
 			ret = xdev->statusStreamStopReason;
 			break;
@@ -835,24 +1469,132 @@ int lsadrv_read_iso_buffer(
 			//ret = -EFAULT;
 			break;
 		}
-		else if ((size = GetRingBufferCurrentSize(ringBuffer))) {
+		else if (lsadrv_signal_pending()) {
+			/* schedule() won't sleep any more */
+			ret = -ERESTARTSYS;
 			break;
 		}
+		else if ((size = GetRingBufferCurrentSize(ringBuffer))) {
+			unsigned long long firstTime, age;
+			signed long slice, left;
+
+			if (minRecords <= 1 ||
+			    GetRingBufferRecordCount(ringBuffer, minRecords) >= minRecords) {
+				break;
+			}
+			if (maxLatency == 0) {
+				timeout = lsadrv_schedule_timeout(timeout);
+				continue;
+			}
+			/* 0: not stamped since the last read, wait for the next urb */
+			firstTime = READ_ONCE(ringBuffer->firstTime);
+			age = firstTime ? lsadrv_get_time_ns() - firstTime : 0;
+			if (age >= maxLatency * 1000ULL) {
+				break;
+			}
+			/* sleep until the next urb or the latency limit */
+			slice = lsadrv_usec_to_jiffies(maxLatency - (unsigned int)(age / 1000));
+			if (slice >= timeout) {
+				timeout = lsadrv_schedule_timeout(timeout);
+				continue;
+			}
+			left = lsadrv_schedule_timeout(slice);
+			if (timeout != MAX_SCHEDULE_TIMEOUT) {
+				timeout -= slice - left;
+			}
+			continue;
+		}
 		timeout = lsadrv_schedule_timeout(timeout);
 	}
+	/* on timeout size still tells what is there, fewer than minRecords or not */
 	//Trace(LSADRV_TRACE_FLOW, "\n");
 	lsadrv_set_current_state(TASK_RUNNING);
 	lsadrv_remove_wait_queue(ringBuffer->waitq, wait);
 
+	*pSize = size;
+	return ret;
+}
+
+/* check that the stream is running; return 0 or the stop reason */
+static int
+CheckIsoStreamStatus(struct lsadrv_device *xdev)
+{
+	if (xdev->statusStreamStopReason != 0 || xdev->StopIsoStream || xdev->CancelIsoStream) {
+		if (xdev->statusStreamStopReason != 0) {
+			Info("read_iso_buffer: stop reason=%d\n", xdev->statusStreamStopReason);
+			return xdev->statusStreamStopReason;
+		}
+		else {
+			Err("read_iso_buffer: stream is stopped\n");
+			return -EFAULT;
+		}
+	}
+	return 0;
+}
+
+int lsadrv_read_iso_buffer(
+	struct lsadrv_device *xdev,
+	unsigned int   PacketCount,
+	unsigned int   PacketSize,
+	void*          dataBuffer,	/* user space */
+	unsigned int*  pBytesRead,
+	signed long    timeout,		/* jiffies */
+	unsigned int   MinRecords,	/* return when this many records are ready, */
+	unsigned int   MaxLatency)	/* or the oldest one is this old (usec, 0: no limit) */
+{
+	struct lsadrv_ring_buffer *ringBuffer;
+	unsigned int bytesToRead;
+	int bytesRead = 0;
+	int ret = 0;
+	unsigned int size = 0;
+
+//	Trace(LSADRV_TRACE_READ, ">> read_iso_buffer\n");
+
+	*pBytesRead = 0;
+
+	ringBuffer = GetStreamRingBuffer(xdev);
+	if (ringBuffer == NULL) {
+		Err("read_iso_buffer: buffer is absent\n");
+		return -EFAULT;
+	}
+
+	if (ringBuffer->packetSize != PacketSize) {
+		Err("read_iso_buffer: PacketSize mismatch\n");
+		ret = -EINVAL;
+		goto l_ret;
+	}
+	/* the ring may be smaller than asked for (lsadrv_max_history) */
+	if (PacketCount > ringBuffer->capacity / ringBuffer->recSize) {
+		PacketCount = ringBuffer->capacity / ringBuffer->recSize;
+	}
+	bytesToRead = PacketCount * ringBuffer->recSize;
+
+	// check error status
+	if ((ret = CheckIsoStreamStatus(xdev))) {
+		goto l_ret;
+	}
+
+	ret = WaitForRingData(xdev, ringBuffer, &size, timeout, min(MinRecords, PacketCount), MaxLatency);
+
 	if (ret) {	/* error */
 		Info("read_iso_buffer: stop reason=%d\n", ret);
 	}
 	else if (size) {
+		unsigned long long firstTime = READ_ONCE(ringBuffer->firstTime);
 		// read data & descriptors from ring buffer
 		bytesRead = ReadRingBuffer(ringBuffer, dataBuffer, bytesToRead);
 		//Trace(LSADRV_TRACE_FLOW, "R[%d]\n", bytesRead);
+		if (bytesRead < 0) {
+			Err("read_iso_buffer: copy_to_user error\n");
+			ret = bytesRead;
+			goto l_ret;
+		}
 		*pBytesRead = bytesRead;
-		Trace(LSADRV_TRACE_FLOW, "read_iso_buffer: %d bytes, frame=%d\n", bytesRead, (dataBuffer[4] | (int) dataBuffer[5] << 8));
+		if (bytesRead > 0) {
+			CountReadLatency(&xdev->stats, firstTime);
+			AdvanceFirstTime(ringBuffer);
+		}
+		trace_lsadrv_ring_read(xdev->devnum, bytesRead, GetRingBufferCurrentSize(ringBuffer));
 	}
 	else {	/* timedout */
 		Trace(LSADRV_TRACE_FLOW, "read_iso_buffer: timed out\n");
@@ -860,5 +1602,218 @@ int lsadrv_read_iso_buffer(
 
 //	Trace(LSADRV_TRACE_READ, "<< read_iso_buffer\n");
 
+l_ret:
+	PutRingBuffer(ringBuffer);
+	return ret;
+}
+
+/* size of one stream record (data + packet descriptor) of the running stream */
+int lsadrv_get_iso_record_size(struct lsadrv_device *xdev)
+{
+	struct lsadrv_ring_buffer *ringBuffer = GetStreamRingBuffer(xdev);
+	int recSize;
+
+	if (ringBuffer == NULL) {
+		return -EFAULT;
+	}
+	recSize = ringBuffer->recSize;
+	PutRingBuffer(ringBuffer);
+	return recSize;
+}
+
+/*
+ * wait for data in the ring (for readers of the mapped ring)
+ *   return: >0: bytes available; 0: timed out; <0: error
+ */
+int lsadrv_wait_iso_buffer(struct lsadrv_device *xdev, signed long timeout)
+{
+	struct lsadrv_ring_buffer *ringBuffer;
+	unsigned int size = 0;
+	int ret;
+
+	ringBuffer = GetStreamRingBuffer(xdev);
+	if (ringBuffer == NULL) {
+		Err("wait_iso_buffer: buffer is absent\n");
+		return -EFAULT;
+	}
+
+	if ((ret = CheckIsoStreamStatus(xdev)) == 0) {
+		ret = WaitForRingData(xdev, ringBuffer, &size, timeout, 1, 0);
+	}
+	PutRingBuffer(ringBuffer);
+	if (ret) {
+		return ret;
+	}
+	return size;
+}
+
+/*
+ * read() of the character device: whole records, blocking while the ring
+ * is empty unless nonblock
+ *   return: bytes read; 0: no stream; <0: error
+ */
+long lsadrv_read_iso_records(struct lsadrv_device *xdev, void *buf, unsigned long count, int nonblock)
+{
+	struct lsadrv_ring_buffer *ringBuffer;
+	unsigned int size = 0;
+	unsigned long long firstTime;
+	long ret;
+
+	/* the stream may be stopped while we sleep */
+	ringBuffer = GetStreamRingBuffer(xdev);
+	if (ringBuffer == NULL) {
+		return 0;
+	}
+
+	/* only the process which claimed the stream can consume the data */
+	if (xdev->iso_claim != lsadrv_getpgrp(NULL)) {
+		Info("read_iso_records: not claimed by process %d\n", lsadrv_getpgrp(NULL));
+		ret = -EACCES;
+		goto l_ret;
+	}
+
+	if (count < ringBuffer->recSize) {
+		ret = -EINVAL;
+		goto l_ret;
+	}
+	count = min(count, (unsigned long)ringBuffer->capacity);
+
+	if ((ret = CheckIsoStreamStatus(xdev))) {
+		goto l_ret;
+	}
+
+	if (nonblock) {
+		size = GetRingBufferCurrentSize(ringBuffer);
+		ret = size ? 0 : -EAGAIN;
+	}
+	else {
+		ret = WaitForRingData(xdev, ringBuffer, &size, MAX_SCHEDULE_TIMEOUT, 1, 0);
+	}
+	if (ret || size == 0) {
+		goto l_ret;
+	}
+
+	firstTime = READ_ONCE(ringBuffer->firstTime);
+	ret = ReadRingBuffer(ringBuffer, buf, count);
+	if (ret > 0) {
+		CountReadLatency(&xdev->stats, firstTime);
+		AdvanceFirstTime(ringBuffer);
+		trace_lsadrv_ring_read(xdev->devnum, ret, GetRingBufferCurrentSize(ringBuffer));
+	}
+
+l_ret:
+	PutRingBuffer(ringBuffer);
+	return ret;
+}
+
+/*
+ * poll() of the character device, after waiting on xdev->stream_wait
+ *   return: >0: bytes available; 0: empty; <0: error or no stream (-ENODATA)
+ */
+int lsadrv_poll_iso_buffer(struct lsadrv_device *xdev)
+{
+	struct lsadrv_ring_buffer *ringBuffer;
+	int ret;
+
+	ringBuffer = GetStreamRingBuffer(xdev);
+	if (ringBuffer == NULL) {
+		return -ENODATA;
+	}
+	if ((ret = CheckIsoStreamStatus(xdev)) == 0) {
+		ret = GetRingBufferCurrentSize(ringBuffer);
+	}
+	PutRingBuffer(ringBuffer);
+	return ret;
+}
+
+/* number of records dropped because the ring was full */
+int lsadrv_get_iso_dropped(struct lsadrv_device *xdev, unsigned int *pDropped)
+{
+	struct lsadrv_ring_buffer *ringBuffer = GetStreamRingBuffer(xdev);
+
+	if (ringBuffer == NULL) {
+		return -EFAULT;
+	}
+	*pDropped = READ_ONCE(ringBuffer->ctrl->Dropped);
+	PutRingBuffer(ringBuffer);
+	return 0;
+}
+
+/***************************************************************************/
+/* mapping the stream ring to user space */
+
+static void lsadrv_iso_vma_open(struct vm_area_struct *vma)
+{
+	struct lsadrv_ring_buffer *ringBuffer = vma->vm_private_data;
+	kref_get(&ringBuffer->ref);
+}
+
+static void lsadrv_iso_vma_close(struct vm_area_struct *vma)
+{
+	struct lsadrv_ring_buffer *ringBuffer = vma->vm_private_data;
+	kref_put(&ringBuffer->ref, ReleaseRingBuffer);
+}
+
+static const struct vm_operations_struct lsadrv_iso_vm_ops = {
+	.open	= lsadrv_iso_vma_open,
+	.close	= lsadrv_iso_vma_close,
+};
+
+/*
+ * map the control page and/or the data of the stream ring.
+ * The data pages may only be mapped read-only.
+ */
+int lsadrv_mmap_iso_buffer(struct lsadrv_device *xdev, struct vm_area_struct *vma)
+{
+	struct lsadrv_ring_buffer *ringBuffer;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+	int ret;
+
+	Trace(LSADRV_TRACE_STREAM, "mmap_iso_buffer: offset=0x%lx, size=0x%lx\n", offset, size);
+
+	ringBuffer = GetStreamRingBuffer(xdev);
+	if (ringBuffer == NULL) {
+		Err("mmap_iso_buffer: buffer is absent\n");
+		return -EFAULT;
+	}
+
+	/* only the process which claimed the stream can look at the data */
+	if (xdev->iso_claim != lsadrv_getpgrp(NULL)) {
+		Info("mmap_iso_buffer: not claimed by process %d\n", lsadrv_getpgrp(NULL));
+		ret = -EACCES;
+		goto l_ret;
+	}
+
+	if (offset >= ringBuffer->mapSize || size > ringBuffer->mapSize - offset) {
+		ret = -EINVAL;
+		goto l_ret;
+	}
+
+	if (offset + size > PAGE_SIZE) {
+		/* covers the data pages */
+		if (vma->vm_flags & VM_WRITE) {
+			ret = -EPERM;
+			goto l_ret;
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+		vm_flags_clear(vma, VM_MAYWRITE);
+#else
+		vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	}
+
+	ret = lsadrv_remap_vmalloc_range(vma, ringBuffer->ctrl, vma->vm_pgoff);
+	if (ret) {
+		goto l_ret;
+	}
+
+	/* the mapping takes its own reference */
+	vma->vm_private_data = ringBuffer;
+	vma->vm_ops = &lsadrv_iso_vm_ops;
+	lsadrv_iso_vma_open(vma);
+
+l_ret:
+	PutRingBuffer(ringBuffer);
 	return ret;
 }
@@ -32,12 +32,21 @@
 #include <linux/kmod.h>		/* for request_module */
 #include <linux/seq_file.h>	/* for single_open */
 #include <linux/usbdevice_fs.h>		/* for USBDEVFS_HUB_PORTINFO */
+#include <linux/fs.h>		/* for file_operations */
+#include <linux/mm.h>		/* for vm_area_struct */
+#include <linux/poll.h>		/* for poll_wait */
 #include <linux/errno.h>
 #include <linux/version.h>
 
 #include "lsadrv.h"
+#if LSADRV_INPUT_MT
+#include <linux/input/mt.h>
+#endif
 #include "lsadrv-ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "lsadrv-trace.h"
+
 /******** USB device ********/
 
 /* hotplug device table support */
@@ -58,6 +67,7 @@ MODULE_DEVICE_TABLE(usb, lsadrv_device_table);
 static int usb_lsadrv_probe(struct usb_interface *intf, const struct usb_device_id *id);
 static void usb_lsadrv_disconnect(struct usb_interface *intf);
 static int usb_lsadrv_ioctl(struct usb_interface *intf, unsigned int cmd, void *arg);
+static struct usb_class_driver lsadrv_class;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
 static struct usb_driver lsadrv_driver =
@@ -83,18 +93,21 @@ static struct usb_driver lsadrv_driver =
 #endif
 
 static LIST_HEAD(device_list);
-static LIST_HEAD(memleak_list);
-static struct semaphore device_list_lock;
+static DEFINE_SPINLOCK(device_list_lock);	/* writers; readers use rcu_read_lock */
 
 
 /******** input device ********/
 static int  lsadrv_input_open(struct input_dev *idev);
 static void lsadrv_input_close(struct input_dev *idev);
 
+/* the input device of fakemouse, which has no board */
 struct lsadrv_input_dev *lsadrv_idev;
 
 /******** global/static variables ********/
 int lsadrv_trace = 0;
+int lsadrv_coherent = 1;	/* coherent DMA buffers for the stream */
+unsigned int lsadrv_max_history = 10000;	/* msec of stream the ring can hold */
+const char *lsadrv_decoder_name = "";	/* in-kernel decoder of the stream */
 
 
 /***************************************************************************/
@@ -144,7 +157,7 @@ static inline void input_set_drvdata(struct input_dev *dev, void *data)
 static int lsadrv_input_open(struct input_dev *idev)
 {
 	int rc = 0;
-	struct lsadrv_input_dev *xidev = lsadrv_idev;
+	struct lsadrv_input_dev *xidev = input_get_drvdata(idev);
 
 	Trace(LSADRV_TRACE_OPEN, ">> input_open: ptr=0x%p\n", idev);
 
@@ -168,7 +181,7 @@ static int lsadrv_input_open(struct input_dev *idev)
 /* called from event handler when input device file (eventNN) is closed */
 static void lsadrv_input_close(struct input_dev *idev)
 {
-	struct lsadrv_input_dev *xidev = lsadrv_idev;
+	struct lsadrv_input_dev *xidev = input_get_drvdata(idev);
 
 	Trace(LSADRV_TRACE_OPEN, ">> input_close: ptr=0x%p\n", idev);
 	if (idev == NULL) {
@@ -195,19 +208,9 @@ static void lsadrv_set_key_bits(struct input_dev *idev)
 	}
 }
 
-static int fill_input_dev(struct lsadrv_input_dev *xidev)
+/* the pointer and keys of LSADRV_IOC_MOUSEEVENT/LSADRV_IOC_KEYBDEVENT */
+static void fill_pointer_input_dev(struct input_dev *idev)
 {
-	struct input_dev *idev;
-	memset(xidev, 0, sizeof(*xidev));
-	idev = input_allocate_device();
-	if (idev == NULL) {
-		return -1;
-	}
-	xidev->idev = idev;
-	input_set_drvdata(idev, xidev);
-	/* idev->int number;  //set in input_register_device() */
-	idev->name = "lsadrv";
-
 #ifdef PREVENT_MOUSE_DRIVER_MATCH
 	idev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
 	idev->keybit[BIT_WORD(BTN_MOUSE)] = BIT_MASK(BTN_RIGHT) | BIT_MASK(BTN_MIDDLE);
@@ -225,6 +228,49 @@ static int fill_input_dev(struct lsadrv_input_dev *xidev)
 	input_set_abs_params(idev, ABS_X, 0, 65535, 0, 0);
 	input_set_abs_params(idev, ABS_Y, 0, 65535, 0, 0);
 	input_set_abs_params(idev, ABS_PRESSURE, 0, 1023, 0, 0);
+}
+
+#if LSADRV_INPUT_MT
+/* multi-touch, protocol B; ABS_X/ABS_Y follow the oldest contact */
+static int fill_touch_input_dev(struct input_dev *idev)
+{
+	idev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
+	input_set_abs_params(idev, ABS_X, 0, 65535, 0, 0);
+	input_set_abs_params(idev, ABS_Y, 0, 65535, 0, 0);
+	input_set_abs_params(idev, ABS_PRESSURE, 0, 1023, 0, 0);
+	input_set_abs_params(idev, ABS_MT_POSITION_X, 0, 65535, 0, 0);
+	input_set_abs_params(idev, ABS_MT_POSITION_Y, 0, 65535, 0, 0);
+	input_set_abs_params(idev, ABS_MT_PRESSURE, 0, 1023, 0, 0);
+	input_set_abs_params(idev, ABS_MT_TOOL_TYPE, 0, MT_TOOL_MAX, 0, 0);
+	return input_mt_init_slots(idev, LSADRV_MT_MAX_CONTACTS, INPUT_MT_DIRECT | INPUT_MT_DROP_UNUSED);
+}
+#endif
+
+/* touch: the multi-touch device of a board (LSADRV_INPUT_MT only), else the pointer device */
+static int fill_input_dev(struct lsadrv_input_dev *xidev, int touch)
+{
+	struct input_dev *idev;
+	memset(xidev, 0, sizeof(*xidev));
+	idev = input_allocate_device();
+	if (idev == NULL) {
+		return -1;
+	}
+	xidev->idev = idev;
+	spin_lock_init(&xidev->report_lock);
+	input_set_drvdata(idev, xidev);
+	/* idev->int number;  //set in input_register_device() */
+	idev->name = touch ? "lsadrv touch" : "lsadrv";
+
+	if (!touch) {
+		fill_pointer_input_dev(idev);
+	}
+#if LSADRV_INPUT_MT
+	else if (fill_touch_input_dev(idev)) {
+		input_free_device(idev);
+		xidev->idev = NULL;
+		return -1;
+	}
+#endif
 
 	/* operations */
 	idev->open = lsadrv_input_open;
@@ -233,12 +279,214 @@ static int fill_input_dev(struct lsadrv_input_dev *xidev)
 	return 0;
 }
 
+/* allocate and register an input device; udev/intf are NULL for fakemouse's */
+static struct lsadrv_input_dev *lsadrv_create_input_dev(struct usb_device *udev, struct usb_interface *intf, int touch)
+{
+	struct lsadrv_input_dev *xidev;
+	int err;
+
+	xidev = kmalloc(sizeof(struct lsadrv_input_dev), GFP_KERNEL);
+	if (xidev == NULL) {
+		Err("could not allocate memory for lsadrv_input_dev.\n");
+		return NULL;
+	}
+	if (fill_input_dev(xidev, touch)) {
+		Err("could not allocate memory for input device.\n");
+		kfree(xidev);
+		return NULL;
+	}
+
+	/* set ids as input device */
+	if (udev) {
+		if (usb_make_path(udev, xidev->phys_path, sizeof(xidev->phys_path)) > 0) {
+			xidev->idev->phys = xidev->phys_path;
+		}
+		usb_to_input_id(udev, &xidev->idev->id);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 10)) && (LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 24))
+		xidev->idev->cdev.dev = &intf->dev;
+#elif LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 24)
+		xidev->idev->dev.parent = &intf->dev;
+#endif
+	}
+
+	/* Register to input subsystem */
+	Debug("registering input device\n");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 15)
+	err = input_register_device(xidev->idev);
+#else
+	input_register_device(xidev->idev);
+	err = 0;
+#endif
+	if (err) {
+		Err("could not register input device.\n");
+		input_free_device(xidev->idev);
+		kfree(xidev);
+		return NULL;
+	}
+	Trace(LSADRV_TRACE_MODULE, "Registered input struct at 0x%p.\n", xidev->idev);
+	Info("Registered input device%s%s\n", xidev->idev->phys ? " at " : "", xidev->idev->phys ? xidev->idev->phys : "");
+	return xidev;
+}
+
+static void lsadrv_destroy_input_dev(struct lsadrv_input_dev *xidev)
+{
+	input_unregister_device(xidev->idev);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 10)
+	input_free_device(xidev->idev);
+#endif
+	kfree(xidev);
+}
+
 /***************************************************************************
  *
  * USB functions
  *
  ***************************************************************************/
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 8, 0)
+static inline int kref_get_unless_zero(struct kref *kref)
+{
+	return atomic_add_unless(&kref->refcount, 1, 0);
+}
+#endif
+
+static void lsadrv_free_device_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct lsadrv_device, rcu));
+}
+
+/* the last reference is gone: disconnect has run and no call is using the device */
+static void lsadrv_release_device(struct kref *kref)
+{
+	struct lsadrv_device *xdev = container_of(kref, struct lsadrv_device, kref);
+
+	Trace(LSADRV_TRACE_PROBE, "release: xdev=0x%p\n", xdev);
+	lsadrv_spin_lock_term(xdev->streamLock);
+	kfree(xdev->ioBuffer);
+	usb_put_dev(xdev->udev);
+	/* the 'devices' file and lsadrv_get_device_by_minor() may still be looking at it */
+	call_rcu(&xdev->rcu, lsadrv_free_device_rcu);
+}
+
+static inline void lsadrv_get_device(struct lsadrv_device *xdev)
+{
+	kref_get(&xdev->kref);
+}
+
+static inline void lsadrv_put_device(struct lsadrv_device *xdev)
+{
+	kref_put(&xdev->kref, lsadrv_release_device);
+}
+
+/* find a plugged device by its character device minor and take a reference */
+static struct lsadrv_device *lsadrv_get_device_by_minor(int minor)
+{
+	struct lsadrv_device *xdev;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(xdev, &device_list, device_list) {
+		/* an unplugged device may still be listed with a minor given to a new one */
+		if (xdev->minor == minor && !xdev->unplugged && kref_get_unless_zero(&xdev->kref)) {
+			rcu_read_unlock();
+			return xdev;
+		}
+	}
+	rcu_read_unlock();
+	return NULL;
+}
+
+/*** sysfs: stream statistics in lsadrv/ of the interface ***/
+static struct lsadrv_device *lsadrv_stats_device(struct device *dev)
+{
+	return (struct lsadrv_device *) usb_get_intfdata(to_usb_interface(dev));
+}
+
+#define LSADRV_STATS_ATTR(name)							\
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf)	\
+{										\
+	struct lsadrv_device *xdev = lsadrv_stats_device(dev);			\
+	if (xdev == NULL) {							\
+		return -ENODEV;							\
+	}									\
+	return sprintf(buf, "%lu\n", READ_ONCE(xdev->stats.name));		\
+}										\
+static DEVICE_ATTR(name, S_IRUGO, name##_show, NULL)
+
+LSADRV_STATS_ATTR(urbs);
+LSADRV_STATS_ATTR(packets);
+LSADRV_STATS_ATTR(bytes_written);
+LSADRV_STATS_ATTR(bytes_dropped);
+LSADRV_STATS_ATTR(max_fill);
+LSADRV_STATS_ATTR(wakeups);
+
+/* "<status> <count>" per line, the other statuses last */
+static ssize_t packet_errors_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct lsadrv_device *xdev = lsadrv_stats_device(dev);
+	ssize_t len = 0;
+	int i;
+
+	if (xdev == NULL) {
+		return -ENODEV;
+	}
+	for (i = 0; i < LSADRV_STATS_STATUSES - 1; i++) {
+		len += sprintf(buf + len, "%d %lu\n", lsadrv_stats_status[i],
+			       READ_ONCE(xdev->stats.packet_errors[i]));
+	}
+	len += sprintf(buf + len, "other %lu\n", READ_ONCE(xdev->stats.packet_errors[i]));
+	return len;
+}
+static DEVICE_ATTR(packet_errors, S_IRUGO, packet_errors_show, NULL);
+
+/* "<usec> <count>" per line: reads of records at least usec old (and less than the next line) */
+static ssize_t latency_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct lsadrv_device *xdev = lsadrv_stats_device(dev);
+	ssize_t len = 0;
+	int i;
+
+	if (xdev == NULL) {
+		return -ENODEV;
+	}
+	for (i = 0; i < LSADRV_STATS_LATENCY_BUCKETS; i++) {
+		len += sprintf(buf + len, "%lu %lu\n", i ? 1UL << (i - 1) : 0UL,
+			       READ_ONCE(xdev->stats.latency[i]));
+	}
+	return len;
+}
+static DEVICE_ATTR(latency, S_IRUGO, latency_show, NULL);
+
+/* counts racing with the reset may survive it */
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct lsadrv_device *xdev = lsadrv_stats_device(dev);
+
+	if (xdev == NULL) {
+		return -ENODEV;
+	}
+	memset(&xdev->stats, 0, sizeof(xdev->stats));
+	return count;
+}
+static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
+
+static struct attribute *lsadrv_stats_attrs[] = {
+	&dev_attr_urbs.attr,
+	&dev_attr_packets.attr,
+	&dev_attr_packet_errors.attr,
+	&dev_attr_bytes_written.attr,
+	&dev_attr_bytes_dropped.attr,
+	&dev_attr_max_fill.attr,
+	&dev_attr_wakeups.attr,
+	&dev_attr_latency.attr,
+	&dev_attr_reset.attr,
+	NULL,
+};
+
+static const struct attribute_group lsadrv_stats_group = {
+	.name =		"lsadrv",
+	.attrs =	lsadrv_stats_attrs,
+};
+
 /* This function gets called when a new device is plugged in or the usb driver is loaded. */
 static int usb_lsadrv_probe(struct usb_interface *intf, const struct usb_device_id *id)
 {
@@ -258,36 +506,68 @@ static int usb_lsadrv_probe(struct usb_interface *intf, const struct usb_device_
 	}
 	memset(xdev, 0, sizeof(struct lsadrv_device));
 
-	xdev->udev = udev;
+	xdev->udev = usb_get_dev(udev);
+	xdev->intf = intf;
+	xdev->minor = -1;
+	xdev->busnum = udev->bus->busnum;
+	xdev->devnum = udev->devnum;
+	kref_init(&xdev->kref);
 	lsadrv_spin_lock_init(&xdev->streamLock);
 	sema_init(&xdev->modlock, 1); 
-	init_waitqueue_head(&xdev->remove_ok);
-
-	/* set ids as input device */
-	if (usb_make_path(xdev->udev, lsadrv_idev->phys_path, sizeof(lsadrv_idev->phys_path)) > 0) {
-		lsadrv_idev->idev->phys = lsadrv_idev->phys_path;
+	mutex_init(&xdev->stream_mutex);
+	init_waitqueue_head(&xdev->stream_wait);
+	sema_init(&xdev->ioBufferLock, 1);
+	xdev->ioBuffer = kmalloc(LSADRV_IO_BUFFER_SIZE, GFP_KERNEL);
+	if (xdev->ioBuffer == NULL) {
+		/* ioctls allocate their buffers then */
+		Warning("could not allocate the i/o buffer.\n");
+	}
+
+	/* input device of this board (mouse/key ioctls; the decoders too without a touch device) */
+	xdev->xidev = lsadrv_create_input_dev(udev, intf, 0);
+	if (xdev->xidev == NULL) {
+		Warning("could not register the input device of the board.\n");
+	}
+#if LSADRV_INPUT_MT
+	/* contacts of the decoders and LSADRV_IOC_MT_FRAME */
+	xdev->touch = lsadrv_create_input_dev(udev, intf, 1);
+	if (xdev->touch == NULL) {
+		Warning("could not register the touch device of the board.\n");
 	}
-	usb_to_input_id(udev, &lsadrv_idev->idev->id);
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 10)) && (LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 24))
-	lsadrv_idev->idev->cdev.dev = &intf->dev;
 #endif
 
-	/* Add it to the device list */
-	down(&device_list_lock);
-	list_add(&xdev->device_list, &device_list);
-	up(&device_list_lock);
+	usb_set_intfdata(intf, xdev);
+
+	if (sysfs_create_group(&intf->dev.kobj, &lsadrv_stats_group)) {
+		Warning("could not create the statistics in sysfs.\n");
+	}
+	else {
+		xdev->stats_group = 1;
+	}
+
+	/* character device for reading and mapping the stream (ioctls still work through devio without it) */
+	if (usb_register_dev(intf, &lsadrv_class)) {
+		Warning("could not get a minor for the character device.\n");
+		xdev->intf = NULL;
+	}
+	else {
+		xdev->minor = intf->minor;
+		Trace(LSADRV_TRACE_PROBE, "probe: character device minor %d\n", intf->minor);
+	}
+
+	/* Add it to the device list; opens of the character device find it there */
+	spin_lock(&device_list_lock);
+	list_add_rcu(&xdev->device_list, &device_list);
+	spin_unlock(&device_list_lock);
 
 	Trace(LSADRV_TRACE_PROBE, "<< probe: returning 0x%p\n", xdev);
-	usb_set_intfdata(intf, xdev);
 	return 0;
 }
 
 /* Usb device is unplugged or driver is shutting down ... */
 static void usb_lsadrv_disconnect(struct usb_interface *intf)
 {
-	DECLARE_WAITQUEUE(wait, current);
 	struct lsadrv_device *xdev;
-	int usage;
 
 	xdev = (struct lsadrv_device *) usb_get_intfdata(intf);
 	usb_set_intfdata(intf, NULL);
@@ -304,45 +584,39 @@ static void usb_lsadrv_disconnect(struct usb_interface *intf)
 		return;
 	}
 
-	/* remove from the device list */
-	down(&device_list_lock);
-	list_del(&xdev->device_list);
-	up(&device_list_lock);
+	/* no new opens of the character device */
+	if (xdev->intf) {
+		usb_deregister_dev(intf, &lsadrv_class);
+	}
 
-	if (xdev->udev == NULL) {
-		Err("disconnect: already called for %p\n", xdev);
-		return;
+	/* waits for the readers of the statistics */
+	if (xdev->stats_group) {
+		sysfs_remove_group(&intf->dev.kobj, &lsadrv_stats_group);
 	}
 
+	/* remove from the device list */
+	spin_lock(&device_list_lock);
+	list_del_rcu(&xdev->device_list);
+	spin_unlock(&device_list_lock);
+
 	xdev->unplugged = 1;
 
+	/* also wakes up readers, which then drop their references */
 	lsadrv_stop_iso_stream(xdev);
 
-	/* wait for i/o in progress done */
-	add_wait_queue(&xdev->remove_ok, &wait);
-	set_current_state(TASK_INTERRUPTIBLE);
-	while ((usage=xdev->usage)) {
-		Trace(LSADRV_TRACE_PROBE, "waiting io: usage=%d\n", usage);
-		schedule();
-	}
-	set_current_state(TASK_RUNNING);
-	remove_wait_queue(&xdev->remove_ok, &wait);
-
-	lsadrv_spin_lock_term(xdev->streamLock);
-
-	/* free memory */
+	/* ioctls come through devio with the device locked, so none is using the input device */
 	Trace(LSADRV_TRACE_PROBE, "disconnect: cleaning up memories.\n");
-	if (lsadrv_idev) {
-		input_set_drvdata(lsadrv_idev->idev, NULL);
-		lsadrv_idev->idev->phys = NULL;
-		lsadrv_idev->idev->id.vendor = 0;
-		lsadrv_idev->idev->id.product = 0;
-		lsadrv_idev->idev->id.version = 0;
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 10)) && (LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 24))
-		lsadrv_idev->idev->cdev.dev = NULL;
-#endif
+	if (xdev->xidev) {
+		lsadrv_destroy_input_dev(xdev->xidev);
+		xdev->xidev = NULL;
+	}
+	if (xdev->touch) {
+		lsadrv_destroy_input_dev(xdev->touch);
+		xdev->touch = NULL;
 	}
-	kfree(xdev);
+
+	/* the rest is freed by the last call in progress */
+	lsadrv_put_device(xdev);
 
 	Trace(LSADRV_TRACE_PROBE, "<< disconnect\n");
 }
@@ -381,18 +655,9 @@ static int usb_lsadrv_ioctl(struct usb_interface *intf, unsigned int cmd, void *
 		goto l_ret;
 	}
 
-	lsadrv_modlock(xdev);
-	xdev->usage++;
-	lsadrv_modunlock(xdev);
-
+	lsadrv_get_device(xdev);
 	ret = lsadrv_usb_ioctl(xdev, cmd, arg);
-
-	lsadrv_modlock(xdev);
-	xdev->usage--;
-	lsadrv_modunlock(xdev);
-
-	/* wake up the waiting threads */
-	wake_up_interruptible(&xdev->remove_ok);
+	lsadrv_put_device(xdev);
 
 l_ret:
 	Trace(LSADRV_TRACE_IOCTL, "<<lsadrv_ioctl(%d): ret=%d\n", _IOC_NR(cmd), ret);
@@ -400,6 +665,106 @@ l_ret:
 }
 
 
+/***************************************************************************/
+/* character device */
+
+/*
+ * an open file holds a reference, so the device (and stream_wait a poller
+ * sleeps on) outlives disconnect until release; the calls check unplugged
+ */
+static int lsadrv_open(struct inode *inode, struct file *file)
+{
+	struct lsadrv_device *xdev;
+
+	Trace(LSADRV_TRACE_OPEN, "open: minor=%d\n", iminor(inode));
+
+	xdev = lsadrv_get_device_by_minor(iminor(inode));
+	if (xdev == NULL) {
+		return -ENODEV;
+	}
+	file->private_data = xdev;
+	return 0;
+}
+
+static int lsadrv_release(struct inode *inode, struct file *file)
+{
+	Trace(LSADRV_TRACE_OPEN, "release: minor=%d\n", iminor(inode));
+	lsadrv_put_device(file->private_data);
+	return 0;
+}
+
+static int lsadrv_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct lsadrv_device *xdev = file->private_data;
+
+	if (xdev->unplugged) {
+		return -ENODEV;
+	}
+	return lsadrv_mmap_iso_buffer(xdev, vma);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
+typedef unsigned int __poll_t;
+#define EPOLLIN		POLLIN
+#define EPOLLRDNORM	POLLRDNORM
+#define EPOLLERR	POLLERR
+#define EPOLLHUP	POLLHUP
+#endif
+
+/* whole stream records; a buffer shorter than one record gets -EINVAL */
+static ssize_t lsadrv_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct lsadrv_device *xdev = file->private_data;
+
+	if (xdev->unplugged) {
+		return -ENODEV;
+	}
+	return lsadrv_read_iso_records(xdev, buf, count, file->f_flags & O_NONBLOCK);
+}
+
+static __poll_t lsadrv_poll(struct file *file, poll_table *wait)
+{
+	struct lsadrv_device *xdev = file->private_data;
+	__poll_t mask;
+	int ret;
+
+	poll_wait(file, &xdev->stream_wait, wait);
+	if (xdev->unplugged) {
+		return EPOLLHUP | EPOLLERR;
+	}
+
+	ret = lsadrv_poll_iso_buffer(xdev);
+	if (ret == -ENODATA) {
+		/* no stream: read() returns 0 */
+		mask = EPOLLHUP;
+	}
+	else if (ret < 0) {
+		mask = EPOLLERR;
+	}
+	else {
+		mask = ret ? EPOLLIN | EPOLLRDNORM : 0;
+	}
+	return mask;
+}
+
+static const struct file_operations lsadrv_fops = {
+	.owner =		THIS_MODULE,
+	.open =			lsadrv_open,
+	.release =		lsadrv_release,
+	.read =			lsadrv_read,
+	.poll =			lsadrv_poll,
+	.mmap =			lsadrv_mmap,
+	.llseek =		noop_llseek,
+};
+
+/* /dev/usb/lsadrvN */
+static struct usb_class_driver lsadrv_class = {
+	.name =			"lsadrv%d",
+	.fops =			&lsadrv_fops,
+	.minor_base =		LSADRV_MINOR_BASE,
+};
+
+
 static struct lsadrv_proc_files {
 	struct proc_dir_entry *lsadrvDirEntry;			/* procfs/driver/lsadrv */
 	struct proc_dir_entry *devicesFileEntry;		/* devices file */
@@ -410,16 +775,13 @@ static struct lsadrv_proc_files {
 /*** seq_file show operation for 'devices' file ***/
 static int lsadrv_devices_show(struct seq_file *m, void *v)
 {
-	struct list_head *tmp;
+	struct lsadrv_device *xdev;
 
-	down(&device_list_lock);
-	tmp = device_list.next;
-	while (tmp != &device_list) {
-		struct lsadrv_device *xdev = list_entry(tmp, struct lsadrv_device, device_list);
-		tmp = tmp->next;
-		seq_printf(m, "%03d/%03d\n", xdev->udev->bus->busnum, xdev->udev->devnum);
+	rcu_read_lock();
+	list_for_each_entry_rcu(xdev, &device_list, device_list) {
+		seq_printf(m, "%03d/%03d\n", xdev->busnum, xdev->devnum);
 	}
-	up(&device_list_lock);
+	rcu_read_unlock();
 	return 0;
 }
 
@@ -512,13 +874,27 @@ static int trace = -1;
 module_param(trace, int, 0644);
 MODULE_PARM_DESC(trace, "For debugging purposes");
 
+static int coherent = 1;
+
+module_param(coherent, int, 0444);
+MODULE_PARM_DESC(coherent, "Isochronous transfer buffers in coherent DMA memory (0: kmalloc, mapped per urb)");
+
+static unsigned int max_history = 10000;
+
+module_param(max_history, uint, 0444);
+MODULE_PARM_DESC(max_history, "Longest stream history a ring buffer may hold, in msec at one packet per frame (default: 10000)");
+
+static char *decoder = "";
+
+module_param(decoder, charp, 0444);
+MODULE_PARM_DESC(decoder, "Name of the in-kernel decoder reporting touches from the stream (default: none, user space decodes)");
+
 MODULE_DESCRIPTION("lsadrv touch sensor driver");
 MODULE_AUTHOR("eIT Co. Ltd. & Xiroku Inc.");
 MODULE_LICENSE("GPL");
 
 static int __init usb_lsadrv_init(void)
 {
-	struct lsadrv_input_dev *xidev;
 	int err;
 
 	Info("lsadrv touch sensor driver version " LSADRV_KDRIVER_VERSION " loaded.\n");
@@ -529,9 +905,17 @@ static int __init usb_lsadrv_init(void)
 		Info("Trace options: 0x%04x\n", trace);
 		lsadrv_trace = trace;
 	}
-
-	Debug("init_Mutex\n");
-	sema_init(&device_list_lock, 1); 
+	/* stream buffers */
+	lsadrv_coherent = coherent;
+	if (!coherent) {
+		Info("Isochronous transfer buffers are mapped per urb\n");
+	}
+	lsadrv_max_history = max_history;
+	/* stream decoder */
+	if (decoder && decoder[0]) {
+		Info("Stream decoder: %s\n", decoder);
+		lsadrv_decoder_name = decoder;
+	}
 
 	/*** create procfs directory and 'devices' file ***/
 	Debug("creating procfs\n");
@@ -541,52 +925,20 @@ static int __init usb_lsadrv_init(void)
 	Debug("request_module\n");
 	request_module("evdev");
 
-	/* Allocate input_dev structure */
+	/* input device of fakemouse; each board registers its own at probe */
 	Debug("allocating input_dev\n");
-	xidev = kmalloc(sizeof(struct lsadrv_input_dev), GFP_KERNEL);
-	if (xidev == NULL) {
-		Err("could not allocate memory for lsadrv_input_dev.\n");
+	lsadrv_idev = lsadrv_create_input_dev(NULL, NULL, 0);
+	if (lsadrv_idev == NULL) {
 		lsadrv_remove_procfs_dir();
 		return -ENOMEM;
 	}
-	if (fill_input_dev(xidev)) {
-		Err("could not allocate memory for input device.\n");
-		kfree(xidev);
-		lsadrv_remove_procfs_dir();
-		return -ENOMEM;
-	}
-
-	lsadrv_idev = xidev;
-
-	/* Register to input subsystem */
-	Debug("registering input device\n");
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 15)
-	err = input_register_device(xidev->idev);
-#else
-	input_register_device(xidev->idev);
-	err = 0;
-#endif
-	if (err) {
-		Err("could not register input device.\n");
-		input_free_device(xidev->idev);
-		lsadrv_idev = NULL;
-		kfree(xidev);
-		lsadrv_remove_procfs_dir();
-		return err;
-	}
-	Trace(LSADRV_TRACE_MODULE, "Registered input struct at 0x%p.\n", xidev->idev);
-	Info("Registered input device\n"/*, xidev->idev.number*/);
 
  	Trace(LSADRV_TRACE_MODULE, "Registering driver at address 0x%p.\n", &lsadrv_driver);
 	err = usb_register(&lsadrv_driver);
 	if (err) {
 		/*Err("failed to register usb device.\n");*/
-		input_unregister_device(xidev->idev); 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 10)
-		input_free_device(xidev->idev);
-#endif
+		lsadrv_destroy_input_dev(lsadrv_idev);
 		lsadrv_idev = NULL;
-		kfree(xidev);
 		lsadrv_remove_procfs_dir();
 	}
 
@@ -597,20 +949,17 @@ static int __init usb_lsadrv_init(void)
 
 static void __exit usb_lsadrv_exit(void)
 {
-	struct list_head *tmp;
-
 	/* unregister usb device */
 	Trace(LSADRV_TRACE_MODULE, "Deregistering usb driver.\n");
 	usb_deregister(&lsadrv_driver);
 
+	/* fakemouse reports on lsadrv_idev */
+	destroy_fakemouse();
+
 	/* unregister input devide */
 	if (lsadrv_idev) {
 		Trace(LSADRV_TRACE_MODULE, "Unregistering input device.\n");
-		input_unregister_device(lsadrv_idev->idev); 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 10)
-		input_free_device(lsadrv_idev->idev);
-#endif
-		kfree(lsadrv_idev);
+		lsadrv_destroy_input_dev(lsadrv_idev);
 		lsadrv_idev = NULL;
 	}
 
@@ -618,20 +967,8 @@ static void __exit usb_lsadrv_exit(void)
 	Debug("removing procfs dir\n");
 	lsadrv_remove_procfs_dir();
 
-	/*** free remained memories ***/
-	tmp = memleak_list.next;
-	if (tmp != &memleak_list) {
-		Debug("freeing remained memories\n");
-		while (tmp != &memleak_list) {
-			struct lsadrv_device *xdev = list_entry(tmp, struct lsadrv_device, device_list);
-			tmp = tmp->next;
-			Trace(LSADRV_TRACE_MODULE, "cleaning up memories:0x%p.\n", xdev);
-			list_del(&xdev->device_list);
-			kfree(xdev);
-		}
-	}
-	// destroy
-        destroy_fakemouse();
+	/* devices released by the last calls are freed after a grace period */
+	rcu_barrier();
 	Info("lsadrv driver removed.\n");
 }
 
@@ -24,6 +24,8 @@
 
 #include <linux/kernel.h> 	/* for linux kernel */
 #include <linux/slab.h>
+#include <linux/vmalloc.h>	/* for vmalloc_user */
+#include <linux/mm.h>		/* for remap_vmalloc_range */
 #include <linux/version.h>
 #if LINUX_VERSION_CODE > KERNEL_VERSION(4, 12, 0)
 #include <linux/uaccess.h>
@@ -31,6 +33,8 @@
 #include <asm/uaccess.h>
 #endif
 #include <linux/sched.h>
+#include <linux/timekeeping.h>	/* for ktime_get_ns */
+#include <linux/completion.h>
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 22)) & (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 31))
 #define find_task_by_pid(pid) find_task_by_pid_type_ns(PIDTYPE_PID, pid, &init_pid_ns)
@@ -68,6 +72,22 @@ void *lsadrv_malloc(size_t n)
 	return kmalloc(n, GFP_KERNEL);
 }
 
+/* zeroed, page aligned memory which can be mapped to user space */
+void *lsadrv_vmalloc_user(size_t n)
+{
+	return vmalloc_user(n);
+}
+
+void lsadrv_vfree(const void *p)
+{
+	vfree(p);
+}
+
+int lsadrv_remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff)
+{
+	return remap_vmalloc_range(vma, addr, pgoff);
+}
+
 void lsadrv_set_current_state(int state)
 {
 	set_current_state(state);
@@ -78,11 +98,24 @@ void lsadrv_schedule(void)
 	schedule();
 }
 
+/* monotonic clock */
+unsigned long long lsadrv_get_time_ns(void)
+{
+	return ktime_get_ns();
+}
+
 signed long lsadrv_schedule_timeout(signed long timeout)
 {
 	return schedule_timeout(timeout);
 }
 
+/* convert a short delay from usec to jiffies (at least 1) */
+signed long lsadrv_usec_to_jiffies(unsigned int usec)
+{
+	signed long jiff = usecs_to_jiffies(usec);
+	return jiff ? jiff : 1;
+}
+
 /* convert timeout from msec to jiffies */
 signed long lsadrv_msec_to_jiffies(__u32 msec)
 {
@@ -161,6 +194,70 @@ void lsadrv_wake_up_interruptible(wait_queue_head_t *q)
 	wake_up_interruptible(q);
 }
 
+void lsadrv_init_completion(struct completion **c)
+{
+	*c = kmalloc(sizeof(struct completion), GFP_KERNEL);
+	if (*c) {
+		init_completion(*c);
+	}
+}
+
+void lsadrv_free_completion(struct completion *c)
+{
+	kfree(c);
+}
+
+void lsadrv_reinit_completion(struct completion *c)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+	reinit_completion(c);
+#else
+	INIT_COMPLETION(*c);
+#endif
+}
+
+void lsadrv_complete(struct completion *c)
+{
+	complete(c);
+}
+
+/* return: 0 if timed out, else the jiffies left */
+unsigned long lsadrv_wait_for_completion_timeout(struct completion *c, unsigned long timeout)
+{
+	return wait_for_completion_timeout(c, timeout);
+}
+
+/*
+ * transfer buffer of a control/bulk ioctl: the device's bounce buffer if
+ * it is big enough and free, kmalloc otherwise
+ */
+unsigned char *lsadrv_get_io_buffer(struct lsadrv_device *xdev, unsigned int len)
+{
+	if (len <= LSADRV_IO_BUFFER_SIZE && xdev->ioBuffer &&
+	    down_trylock(&xdev->ioBufferLock) == 0) {
+		return xdev->ioBuffer;
+	}
+	return lsadrv_malloc(len);
+}
+
+void lsadrv_put_io_buffer(struct lsadrv_device *xdev, unsigned char *buf)
+{
+	if (buf == NULL) {
+		return;
+	}
+	if (buf == xdev->ioBuffer) {
+		up(&xdev->ioBufferLock);
+	}
+	else {
+		lsadrv_free(buf);
+	}
+}
+
+int lsadrv_signal_pending(void)
+{
+	return signal_pending(current);
+}
+
 void lsadrv_modlock(struct lsadrv_device *xdev)
 {
 	down(&xdev->modlock);
@@ -257,6 +354,25 @@ struct urb *lsadrv_usb_alloc_urb(int iso_packets)
 	return usb_alloc_urb(iso_packets, GFP_KERNEL);
 }
 
+/* DMA-consistent transfer buffer, no cache maintenance per submission */
+void *lsadrv_usb_alloc_coherent(struct usb_device *dev, size_t size, dma_addr_t *dma)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	return usb_alloc_coherent(dev, size, GFP_KERNEL, dma);
+#else
+	return usb_buffer_alloc(dev, size, GFP_KERNEL, dma);
+#endif
+}
+
+void lsadrv_usb_free_coherent(struct usb_device *dev, size_t size, void *addr, dma_addr_t dma)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	usb_free_coherent(dev, size, addr, dma);
+#else
+	usb_buffer_free(dev, size, addr, dma);
+#endif
+}
+
 /*
  * Isochronous transfer urb completion routine
  */
@@ -276,6 +392,7 @@ void lsadrv_fill_isoc_urb(
 	unsigned int pipe,
 	void *context,
 	void *buffer,
+	dma_addr_t *dma,	// DMA address of a coherent buffer, NULL to map on each submission
 	unsigned int num_packets,
 	unsigned int packet_size,
 	unsigned int buffer_inc)	// buffer address increment per packet
@@ -288,6 +405,10 @@ void lsadrv_fill_isoc_urb(
 	urb->transfer_flags = URB_ISO_ASAP;
         urb->transfer_buffer = buffer;
         urb->transfer_buffer_length = buffer_length;
+	if (dma) {
+		urb->transfer_dma = *dma;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
         urb->complete = lsadrv_isoc_complete;
         urb->context = context;
 	urb->start_frame = 0;
@@ -299,6 +420,11 @@ void lsadrv_fill_isoc_urb(
 	urb->interval = 1;
 }
 
+int lsadrv_get_isoc_start_frame(struct urb *urb)
+{
+	return urb->start_frame;
+}
+
 void lsadrv_get_isoc_desc(struct urb *urb, unsigned int idx, unsigned int *status, unsigned int *actual_length)
 {
 	*status = urb->iso_frame_desc[idx].status;
@@ -310,15 +436,42 @@ void lsadrv_usb_free_urb(struct urb *urb)
 	usb_free_urb(urb);
 }
 
-int lsadrv_usb_submit_urb(struct urb *urb)
+/* the urb stays on the anchor while it is in flight */
+int lsadrv_usb_submit_urb(struct urb *urb, struct usb_anchor *anchor)
 {
-	return usb_submit_urb(urb, GFP_ATOMIC);
+	int ret;
+
+	usb_anchor_urb(urb, anchor);
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if (ret) {
+		usb_unanchor_urb(urb);
+	}
+	return ret;
 }
 
-int lsadrv_usb_resubmit_urb(struct urb *urb, struct usb_device *dev)
+int lsadrv_usb_resubmit_urb(struct urb *urb, struct usb_device *dev, struct usb_anchor *anchor)
 {
 	urb->dev = dev;
-	return usb_submit_urb(urb, GFP_ATOMIC);
+	return lsadrv_usb_submit_urb(urb, anchor);
+}
+
+void lsadrv_init_usb_anchor(struct usb_anchor **anchor)
+{
+	*anchor = kmalloc(sizeof(struct usb_anchor), GFP_KERNEL);
+	if (*anchor) {
+		init_usb_anchor(*anchor);
+	}
+}
+
+void lsadrv_free_usb_anchor(struct usb_anchor *anchor)
+{
+	kfree(anchor);
+}
+
+/* cancel the urbs in flight and wait for their completion handlers; resubmissions fail meanwhile */
+void lsadrv_usb_kill_anchored_urbs(struct usb_anchor *anchor)
+{
+	usb_kill_anchored_urbs(anchor);
 }
 
 int lsadrv_usb_unlink_urb(struct urb *urb)
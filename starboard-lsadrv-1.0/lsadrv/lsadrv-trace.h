@@ -0,0 +1,179 @@
+/*==========================================================================
+ * lsadrv-trace.h : tracepoints of the lsadrv hot paths
+ *
+ * Copyright (C) 2009  eIT Co., Ltd. and Xiroku Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+============================================================================*/
+
+/*
+ * The events show up under /sys/kernel/debug/tracing/events/lsadrv/ and
+ * cost a not-taken branch while disabled, so unlike Trace() they can stay
+ * on the urb completion and read paths.  lsadrv-main.c defines
+ * CREATE_TRACE_POINTS before including this file.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lsadrv
+
+#if !defined(LSADRV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define LSADRV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* an iso urb was (re)submitted; ret is the usb_submit_urb() result */
+TRACE_EVENT(lsadrv_urb_submit,
+	TP_PROTO(int devnum, int frame, int ret),
+	TP_ARGS(devnum, frame, ret),
+	TP_STRUCT__entry(
+		__field(int, devnum)
+		__field(int, frame)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->devnum = devnum;
+		__entry->frame = frame;
+		__entry->ret = ret;
+	),
+	TP_printk("dev=%d urb=%d ret=%d",
+		__entry->devnum, __entry->frame, __entry->ret)
+);
+
+/* an iso urb completed */
+TRACE_EVENT(lsadrv_urb_complete,
+	TP_PROTO(int devnum, int frame, int status, unsigned int packets),
+	TP_ARGS(devnum, frame, status, packets),
+	TP_STRUCT__entry(
+		__field(int, devnum)
+		__field(int, frame)
+		__field(int, status)
+		__field(unsigned int, packets)
+	),
+	TP_fast_assign(
+		__entry->devnum = devnum;
+		__entry->frame = frame;
+		__entry->status = status;
+		__entry->packets = packets;
+	),
+	TP_printk("dev=%d urb=%d status=%d packets=%u",
+		__entry->devnum, __entry->frame, __entry->status, __entry->packets)
+);
+
+DECLARE_EVENT_CLASS(lsadrv_ring_class,
+	TP_PROTO(int devnum, unsigned int bytes, unsigned int fill),
+	TP_ARGS(devnum, bytes, fill),
+	TP_STRUCT__entry(
+		__field(int, devnum)
+		__field(unsigned int, bytes)
+		__field(unsigned int, fill)
+	),
+	TP_fast_assign(
+		__entry->devnum = devnum;
+		__entry->bytes = bytes;
+		__entry->fill = fill;
+	),
+	TP_printk("dev=%d bytes=%u fill=%u",
+		__entry->devnum, __entry->bytes, __entry->fill)
+);
+
+/* the records of one urb were appended to the stream ring */
+DEFINE_EVENT(lsadrv_ring_class, lsadrv_ring_write,
+	TP_PROTO(int devnum, unsigned int bytes, unsigned int fill),
+	TP_ARGS(devnum, bytes, fill)
+);
+
+/* a reader took records out of the stream ring */
+DEFINE_EVENT(lsadrv_ring_class, lsadrv_ring_read,
+	TP_PROTO(int devnum, unsigned int bytes, unsigned int fill),
+	TP_ARGS(devnum, bytes, fill)
+);
+
+/* the writer dropped the oldest records to make room */
+TRACE_EVENT(lsadrv_ring_drop,
+	TP_PROTO(int devnum, unsigned int count, unsigned int total),
+	TP_ARGS(devnum, count, total),
+	TP_STRUCT__entry(
+		__field(int, devnum)
+		__field(unsigned int, count)
+		__field(unsigned int, total)
+	),
+	TP_fast_assign(
+		__entry->devnum = devnum;
+		__entry->count = count;
+		__entry->total = total;
+	),
+	TP_printk("dev=%d records=%u total=%u",
+		__entry->devnum, __entry->count, __entry->total)
+);
+
+/* the urb completion wakes up the readers of the stream ring */
+TRACE_EVENT(lsadrv_reader_wakeup,
+	TP_PROTO(int devnum, unsigned int fill),
+	TP_ARGS(devnum, fill),
+	TP_STRUCT__entry(
+		__field(int, devnum)
+		__field(unsigned int, fill)
+	),
+	TP_fast_assign(
+		__entry->devnum = devnum;
+		__entry->fill = fill;
+	),
+	TP_printk("dev=%d fill=%u", __entry->devnum, __entry->fill)
+);
+
+/* a mouse event injected by LSADRV_IOC_MOUSEEVENT or LSADRV_IOC_INPUTEVENTS */
+TRACE_EVENT(lsadrv_mouse_event,
+	TP_PROTO(int dx, int dy, int flags),
+	TP_ARGS(dx, dy, flags),
+	TP_STRUCT__entry(
+		__field(int, dx)
+		__field(int, dy)
+		__field(int, flags)
+	),
+	TP_fast_assign(
+		__entry->dx = dx;
+		__entry->dy = dy;
+		__entry->flags = flags;
+	),
+	TP_printk("dx=%d dy=%d flags=0x%x",
+		__entry->dx, __entry->dy, __entry->flags)
+);
+
+/* a key event injected by LSADRV_IOC_KEYBDEVENT or LSADRV_IOC_INPUTEVENTS */
+TRACE_EVENT(lsadrv_key_event,
+	TP_PROTO(int vkey, int key, int flags),
+	TP_ARGS(vkey, key, flags),
+	TP_STRUCT__entry(
+		__field(int, vkey)
+		__field(int, key)
+		__field(int, flags)
+	),
+	TP_fast_assign(
+		__entry->vkey = vkey;
+		__entry->key = key;
+		__entry->flags = flags;
+	),
+	TP_printk("vkey=0x%x key=%d flags=0x%x",
+		__entry->vkey, __entry->key, __entry->flags)
+);
+
+#endif /* LSADRV_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lsadrv-trace
+#include <trace/define_trace.h>
@@ -10,6 +10,9 @@
 
 #include <linux/spinlock.h>
 #include <linux/wait.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 
 #include <linux/version.h>
 
@@ -32,11 +35,24 @@
 
 /* Driver version */
 #define LSADRV_KDRIVER_MAJOR	1
-#define LSADRV_KDRIVER_MINOR	2
-#define LSADRV_KDRIVER_BUILD	3
-#define LSADRV_KDRIVER_VERSION 	"1.2.3"
+#define LSADRV_KDRIVER_MINOR	3
+#define LSADRV_KDRIVER_BUILD	0
+#define LSADRV_KDRIVER_VERSION 	"1.3.0"
+
+/* multi-touch device of each board (input_mt_assign_slots with dmax) */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+#define LSADRV_INPUT_MT		1
+#else
+#define LSADRV_INPUT_MT		0
+#endif
 #define LSADRV_NAME 	"lsadrv"
 
+/* first minor of the character devices (without CONFIG_USB_DYNAMIC_MINORS) */
+#define LSADRV_MINOR_BASE	240
+
+/* control/bulk ioctls up to this size don't allocate a transfer buffer */
+#define LSADRV_IO_BUFFER_SIZE	4096
+
 /* Defines and structures for the eIT-Xiroku light sensor */
 
 /* Trace certain actions in the driver */
@@ -76,32 +92,82 @@
 extern "C" {
 #endif
 
+struct vm_area_struct;
+struct completion;
+struct usb_anchor;
+struct lsadrv_decoder;
+struct lsadrv_mt_frame;
+struct lsadrv_contact;
+struct lsadrv_input_dev;
+
+/* packet statuses counted one by one in packet_errors[]; the last counter takes the others */
+#define LSADRV_STATS_STATUSES		9
+/* log2 buckets of the completion-to-read latency (usec); the last one takes the longer ones */
+#define LSADRV_STATS_LATENCY_BUCKETS	24
+
+/*
+ * stream health counters of a device, kept across streams and shown in
+ * lsadrv/ of the interface in sysfs (writing to 'reset' clears them).
+ * Updated without locking: the urb completion counts all but the latency,
+ * which the readers count.
+ */
+struct lsadrv_stats
+{
+	unsigned long urbs;			/* urbs completed */
+	unsigned long packets;			/* packets with data */
+	unsigned long packet_errors[LSADRV_STATS_STATUSES];	/* by lsadrv_stats_status[] */
+	unsigned long bytes_written;		/* to the ring */
+	unsigned long bytes_dropped;		/* overwritten before being read */
+	unsigned long max_fill;			/* bytes in the ring */
+	unsigned long wakeups;			/* of the readers */
+	unsigned long latency[LSADRV_STATS_LATENCY_BUCKETS];
+};
+
 /* main lsadrv device data */
 struct lsadrv_device
 {
 	/* Pointer to our usb_device */
 	struct usb_device *udev;
+	/* our interface, registered with the lsadrv character device */
+	struct usb_interface *intf;
 
-	/* link to device list */
+	/* link to device list (RCU) */
 	struct list_head device_list;
+	struct rcu_head rcu;
+	/* held by the device list until disconnect, by ioctls and character device calls in progress */
+	struct kref kref;
+	int minor;		/* of the character device; -1: none */
+	int busnum, devnum;	/* for the 'devices' file */
    
 	int unplugged;		/* set when the plug is pulled */
-	int usage;		/* number of i/o in progress */
 
 	/* isochronous stream stuff */
 	int iso_claim;
+	struct mutex stream_mutex;	/* start/stop: iso_init, stream, parkedStream */
 	int iso_init;
 	struct lsadrv_iso_stream_object *stream;
+	struct lsadrv_iso_stream_object *parkedStream;	/* stopped stream kept for the next start */
 	spinlock_t	*streamLock;
 	int StopIsoStream;
 	int CancelIsoStream;
 	int statusStreamStopReason;
 	int LastFailedUrbStatus;
 	int LastFailedStreamUrbStatus;
+	wait_queue_head_t stream_wait;	/* stream data arrived or the stream stopped */
+
+	/* bounce buffer of control/bulk ioctls (LSADRV_IO_BUFFER_SIZE) */
+	unsigned char *ioBuffer;
+	struct semaphore ioBufferLock;
+
+	/* input device of this board */
+	struct lsadrv_input_dev *xidev;
+	/* multi-touch device of this board (LSADRV_INPUT_MT), NULL if none */
+	struct lsadrv_input_dev *touch;
+
+	struct lsadrv_stats stats;
+	int stats_group;	/* lsadrv/ is in sysfs */
    
-	struct semaphore modlock;
-	/*** Misc. data ***/
-	wait_queue_head_t remove_ok;		/* When we got hot unplugged, we have to avoid a few race conditions */
+	struct semaphore modlock;	/* iso_claim */
 };
 
 /* lsadrv input device data */
@@ -111,10 +177,14 @@ struct lsadrv_input_dev
 	char			phys_path[64];
 	int			open;	/* open count */
 	int			mouse_data[4];
+	spinlock_t		report_lock;	/* a frame of lsadrv_report_contacts() */
 };
 
 /* Global variables */
 extern int lsadrv_trace;
+extern int lsadrv_coherent;
+extern unsigned int lsadrv_max_history;
+extern const char *lsadrv_decoder_name;
 
 /* functions defined in lsadrv-ioctl.c */
 int lsadrv_usb_ioctl(struct lsadrv_device *xdev, unsigned int cmd, void *arg);
@@ -126,16 +196,32 @@ int lsadrv_start_iso_stream(
 	unsigned int PacketSize,
 	unsigned int PacketCount,
 	unsigned int FramesPerBuffer,
-	unsigned int BufferCount);
+	unsigned int BufferCount,
+	unsigned int Flags);
 int lsadrv_stop_iso_stream(struct lsadrv_device *xdev);
 int lsadrv_read_iso_buffer(
 	struct lsadrv_device *xdev,
 	unsigned int   PacketCount,
 	unsigned int   PacketSize,
-	unsigned char* dataBuffer,
+	void*          dataBuffer,	/* user space */
 	unsigned int*  pBytesRead,
-	signed long    timeout);		/* jiffies */
+	signed long    timeout,		/* jiffies */
+	unsigned int   MinRecords,
+	unsigned int   MaxLatency);	/* usec */
 void lsadrv_isoc_handler(void *context, int status);
+int lsadrv_get_iso_record_size(struct lsadrv_device *xdev);
+int lsadrv_wait_iso_buffer(struct lsadrv_device *xdev, signed long timeout);	/* jiffies */
+int lsadrv_get_iso_dropped(struct lsadrv_device *xdev, unsigned int *pDropped);
+int lsadrv_mmap_iso_buffer(struct lsadrv_device *xdev, struct vm_area_struct *vma);
+long lsadrv_read_iso_records(struct lsadrv_device *xdev, void *buf, unsigned long count, int nonblock);
+int lsadrv_poll_iso_buffer(struct lsadrv_device *xdev);
+extern const int lsadrv_stats_status[LSADRV_STATS_STATUSES - 1];
+
+/* functions defined in lsadrv-decoder.c */
+struct lsadrv_decoder *lsadrv_get_decoder(const char *name);
+void lsadrv_put_decoder(struct lsadrv_decoder *decoder);
+void lsadrv_report_contacts(struct lsadrv_device *xdev, const struct lsadrv_contact *contacts, int count);
+int lsadrv_report_mt_frame(struct lsadrv_device *xdev, const struct lsadrv_mt_frame *frame);
 
 /* functions defined in lsadrv-vkey.c */
 int lsadrv_get_key_list(const int **list);
@@ -145,10 +231,15 @@ void lsadrv_printk(const char *fmt, ...)
 	__attribute__ ((format (printf, 1, 2)));
 void lsadrv_free(const void *);
 void *lsadrv_malloc(size_t);
+void *lsadrv_vmalloc_user(size_t);
+void lsadrv_vfree(const void *);
+int lsadrv_remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff);
 void lsadrv_set_current_state(int state);
 void lsadrv_schedule(void);
 signed long lsadrv_schedule_timeout(signed long timeout);
+unsigned long long lsadrv_get_time_ns(void);
 signed long lsadrv_msec_to_jiffies(__u32 msec);
+signed long lsadrv_usec_to_jiffies(unsigned int usec);
 void lsadrv_init_waitqueue_head(wait_queue_head_t **q);
 void lsadrv_free_waitqueue_head(wait_queue_head_t *q);
 void lsadrv_init_waitqueue_entry(void *buf, int size);
@@ -160,6 +251,14 @@ void lsadrv_add_wait_queue(wait_queue_head_t *q, wait_queue_t *wait);
 void lsadrv_remove_wait_queue(wait_queue_head_t *q, wait_queue_t *wait);
 #endif
 void lsadrv_wake_up_interruptible(wait_queue_head_t *q);
+void lsadrv_init_completion(struct completion **c);
+void lsadrv_free_completion(struct completion *c);
+void lsadrv_reinit_completion(struct completion *c);
+void lsadrv_complete(struct completion *c);
+unsigned long lsadrv_wait_for_completion_timeout(struct completion *c, unsigned long timeout);
+unsigned char *lsadrv_get_io_buffer(struct lsadrv_device *xdev, unsigned int len);
+void lsadrv_put_io_buffer(struct lsadrv_device *xdev, unsigned char *buf);
+int lsadrv_signal_pending(void);
 void lsadrv_modlock(struct lsadrv_device *xdev);
 void lsadrv_modunlock(struct lsadrv_device *xdev);
 void lsadrv_spin_lock_init(spinlock_t **lock);
@@ -177,19 +276,26 @@ void lsadrv_input_report_key(struct input_dev *dev, unsigned int code, int value
 void lsadrv_input_report_abs(struct input_dev *dev, unsigned int code, int value);
 void lsadrv_input_report_rel(struct input_dev *dev, unsigned int code, int value);
 struct urb *lsadrv_usb_alloc_urb(int iso_packets);
+void *lsadrv_usb_alloc_coherent(struct usb_device *dev, size_t size, dma_addr_t *dma);
+void lsadrv_usb_free_coherent(struct usb_device *dev, size_t size, void *addr, dma_addr_t dma);
 void lsadrv_fill_isoc_urb(
 	struct urb *urb,
 	struct usb_device *dev,
 	unsigned int pipe,
 	void *context,
 	void *buffer,
+	dma_addr_t *dma,	// NULL: buffer is mapped on each submission
 	unsigned int num_packets,
 	unsigned int packet_size,
 	unsigned int buffer_inc);	// buffer address increment per packet
+int lsadrv_get_isoc_start_frame(struct urb *urb);
 void lsadrv_get_isoc_desc(struct urb *urb, unsigned int idx, unsigned int *status, unsigned int *actual_length);
 void lsadrv_usb_free_urb (struct urb *urb);
-int lsadrv_usb_submit_urb(struct urb *urb);
-int lsadrv_usb_resubmit_urb(struct urb *urb, struct usb_device *dev);
+int lsadrv_usb_submit_urb(struct urb *urb, struct usb_anchor *anchor);
+int lsadrv_usb_resubmit_urb(struct urb *urb, struct usb_device *dev, struct usb_anchor *anchor);
+void lsadrv_init_usb_anchor(struct usb_anchor **anchor);
+void lsadrv_free_usb_anchor(struct usb_anchor *anchor);
+void lsadrv_usb_kill_anchored_urbs(struct usb_anchor *anchor);
 int lsadrv_usb_unlink_urb(struct urb *urb);
 int lsadrv_usb_bulk_msg(struct usb_device *usb_dev, unsigned int pipe, void *data, int len, int *actual_length, int timeout);
 int lsadrv_usb_control_msg(struct usb_device *dev, unsigned int pipe, __u8 request, __u8 requesttype, __u16 value, __u16 index, void *data, __u16 size, int timeout);